@@ -0,0 +1,507 @@
+/* Scheduler microbenchmarks
+ *
+ * Measures, for 10 up to 1M tasks:
+ *   schedule    cost of schedule() per task
+ *   dispatch    cost of one rq_run() per task, on virtual time so no frame
+ *               sleeps are included
+ *   wakeup      latency between a sleeping task's deadline and the moment it
+ *               runs, on the real clock with mixed sleep patterns
+ *   memory      bytes per task, from the RunQueue's slabs and from RSS
+ *
+ * And for BURST_TASKS timers coming due in the same millisecond:
+ *   burst_heap  cost per node of popping them off an IPQueue64 one at a time
+ *               against ipq_dequeue_until(), next to n timers not yet due
+ *   burst_wake  cost per task of scheduler_wake_tasks() moving them from the
+ *               timer wheel onto BURST_RQS RunQueues
+ *
+ * And for PACER_FRAMES frames of random work paced to PACER_RATE:
+ *   pacer       how late frames start past their target, the number of frames
+ *               overrunning it and the total drift, without spinning and
+ *               spinning the last PACER_SPIN_US us of each wait
+ *
+ * Results are written as "bench,tasks,metric,value" lines, one per metric.
+ *
+ *   $ python build.py bench
+ *   $ ./sched_bench [output] [max tasks]
+ *
+ * The soak mode instead runs days of uptime on virtual time, well past the
+ * point where 32-bit millisecond timestamps used to wrap, and checks that
+ * periodic tasks keep their phase, long sleeps and runtime deadlines end on
+ * time and entity style heap ticks never stall. It exits with 1 on failure.
+ *
+ *   $ python build.py soak
+ *   $ ./sched_bench soak [days]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curseminer/globals.h"
+#include "curseminer/scheduler.h"
+#include "curseminer/stack64.h"
+#include "curseminer/arch.h"
+
+#define BENCH_OUTPUT "bench_output.txt"
+#define BENCH_TASKS_MAX 1000000
+#define DISPATCH_RUNS 8
+#define WAKEUPS_PER_TASK 3
+#define BURST_TASKS 10000
+#define BURST_RQS 4
+#define PACER_RATE 120
+#define PACER_FRAMES 240
+#define PACER_SPIN_US 300
+#define SOAK_DAYS 120
+#define SOAK_TASKS 16
+#define SOAK_ENTITIES 64
+#define SOAK_DAY_MS ((milliseconds_t) 24 * 3600 * 1000)
+#define SOAK_SLEEP_MS (7 * SOAK_DAY_MS)
+#define SOAK_ENTITY_MS 5000 // Period of the entity tick job
+
+struct Globals GLOBALS;
+
+static FILE *g_out;
+static uint64_t g_dispatched;
+static uint32_t *g_latencies;
+static uint64_t g_latencies_c;
+
+// Mixed sleep patterns in milliseconds: busy, short, frame, slow and idle
+static const int g_patterns[] = {1, 5, 16, 100, 250};
+#define PATTERNS_C (sizeof(g_patterns) / sizeof(g_patterns[0]))
+
+
+static uint64_t now_us() {
+    TimeStamp ts;
+    arch_get_time_monotonic(&ts);
+
+    return (uint64_t) ts.sec * 1000000 + ts.usec;
+}
+
+static uint64_t rss_bytes() {
+    FILE *f = fopen("/proc/self/statm", "r");
+    unsigned long size, resident = 0;
+
+    if (f == NULL) return 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+
+    fclose(f);
+
+    return (uint64_t) resident * PAGE_SIZE;
+}
+
+static void report(const char *bench, int n, const char *metric, double value) {
+    fprintf(g_out, "%s,%d,%s,%.3f\n", bench, n, metric, value);
+    printf("%-10s %8d  %-18s %12.3f\n", bench, n, metric, value);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(uint32_t *sorted, uint64_t c, double p) {
+    if (c == 0) return 0;
+
+    uint64_t i = (uint64_t) (p * (c - 1));
+
+    return sorted[i];
+}
+
+
+/* Jobs */
+static int job_dispatch(Task *task, Stack64*) {
+    g_dispatched++;
+
+    if (DISPATCH_RUNS <= ++task->extra) tk_kill(task);
+
+    return 0;
+}
+
+// Stack64 carries the task's sleep pattern, each run is a wakeup
+static int job_wakeup(Task *task, Stack64 *st) {
+    uint64_t now = now_us();
+    milliseconds_t now_ms = now / 1000;
+
+    int64_t late_ms = time_ms_delta(now_ms, task->next_run);
+    int64_t late_us = (int64_t) late_ms * 1000 + now % 1000;
+
+    g_latencies[g_latencies_c++] = late_us < 0 ? 0 : late_us;
+
+    if (WAKEUPS_PER_TASK <= ++task->extra) {
+        tk_kill(task);
+        return 0;
+    }
+
+    int ms = g_patterns[(uintptr_t) st % PATTERNS_C];
+    tk_sleep(task, ms + (uintptr_t) st % 3);
+
+    return 0;
+}
+
+
+/* Benchmarks */
+static RunQueue *bench_setup(ll_head **rqll, int virtual) {
+    time_init(120);
+
+    *rqll = scheduler_init();
+    RunQueue *rq = scheduler_new_rq_(*rqll);
+
+    scheduler_set_tickless(1);
+    scheduler_set_virtual(virtual);
+
+    return rq;
+}
+
+static void bench_teardown(ll_head *rqll, RunQueue *rq) {
+    scheduler_set_virtual(0);
+    scheduler_free();
+    rq_free(rq);
+    ll_free(rqll);
+}
+
+static void bench_dispatch(int n) {
+    ll_head *rqll;
+    uint64_t rss_start = rss_bytes();
+
+    RunQueue *rq = bench_setup(&rqll, 1);
+
+    uint64_t start = now_us();
+
+    for (int i = 0; i < n; i++)
+        schedule(rq, 0, 0, job_dispatch, NULL);
+
+    uint64_t scheduled = now_us();
+
+    int slabs = 0;
+    for (TaskSlab *slab = rq->slabs; slab; slab = slab->next) slabs++;
+
+    uint64_t rss = rss_bytes() - rss_start;
+
+    g_dispatched = 0;
+    schedule_run(rqll);
+
+    uint64_t end = now_us();
+
+    report("schedule", n, "ns_per_task", (scheduled - start) * 1000.0 / n);
+    report("dispatch", n, "ns_per_run",
+            (end - scheduled) * 1000.0 / (g_dispatched ? g_dispatched : 1));
+    report("memory", n, "task_struct_bytes", sizeof(Task));
+    report("memory", n, "slab_bytes_per_task",
+            (double) slabs * RQ_MEMPOOL_SIZE / n);
+    report("memory", n, "rss_bytes_per_task", (double) rss / n);
+
+    bench_teardown(rqll, rq);
+}
+
+static void bench_wakeup(int n) {
+    ll_head *rqll;
+    RunQueue *rq = bench_setup(&rqll, 0);
+
+    g_latencies = malloc(sizeof(uint32_t) * n * WAKEUPS_PER_TASK);
+    g_latencies_c = 0;
+
+    for (uintptr_t i = 0; i < (uintptr_t) n; i++)
+        schedule(rq, 1 + i % 10, 0, job_wakeup, (Stack64*) i);
+
+    uint64_t start = now_us();
+    schedule_run(rqll);
+    uint64_t end = now_us();
+
+    qsort(g_latencies, g_latencies_c, sizeof(uint32_t), cmp_u32);
+
+    report("wakeup", n, "wakeups", g_latencies_c);
+    report("wakeup", n, "p50_us", percentile(g_latencies, g_latencies_c, .50));
+    report("wakeup", n, "p90_us", percentile(g_latencies, g_latencies_c, .90));
+    report("wakeup", n, "p99_us", percentile(g_latencies, g_latencies_c, .99));
+    report("wakeup", n, "p999_us", percentile(g_latencies, g_latencies_c, .999));
+    report("wakeup", n, "max_us", percentile(g_latencies, g_latencies_c, 1));
+    report("wakeup", n, "wall_ms", (end - start) / 1000.0);
+
+    free(g_latencies);
+    bench_teardown(rqll, rq);
+}
+
+static int job_burst(Task *task, Stack64*) {
+    g_dispatched++;
+    tk_kill(task);
+
+    return 0;
+}
+
+static void bench_burst_heap(int n) {
+    int total = n + BURST_TASKS;
+    IHeapNode *nodes = malloc(sizeof(IHeapNode) * total);
+    IHeapNode **out = malloc(sizeof(IHeapNode*) * BURST_TASKS);
+    IPQueue64 *pq = ipq_init(1);
+    uint64_t t_single = 0, t_bulk = 0;
+    int got = 0;
+
+    for (int round = 0; round < 2; round++) {
+        // Due timers weigh 0..9, the rest are spread out after them
+        for (int i = 0; i < total; i++) {
+            ipq_node_init(nodes + i);
+            ipq_enqueue(pq, nodes + i,
+                    i < BURST_TASKS ? i % 10 : 10 + (int) (((uint64_t) i * 7919) % total));
+        }
+
+        uint64_t start = now_us();
+
+        if (round == 0) {
+            while (ipq_peek_weight(pq) < 10) {
+                ipq_dequeue(pq);
+                got++;
+            }
+
+            t_single = now_us() - start;
+
+        } else {
+            got += ipq_dequeue_until(pq, 9, out, BURST_TASKS);
+            t_bulk = now_us() - start;
+        }
+
+        ipq_clear(pq);
+    }
+
+    report("burst_heap", n, "dequeue_ns_per_node", t_single * 1000.0 / BURST_TASKS);
+    report("burst_heap", n, "until_ns_per_node", t_bulk * 1000.0 / BURST_TASKS);
+    report("burst_heap", n, "speedup", (double) t_single / (t_bulk ? t_bulk : 1));
+
+    if (got != BURST_TASKS * 2) printf("burst_heap: only got %d nodes\n", got);
+
+    ipq_free(pq);
+    free(out);
+    free(nodes);
+}
+
+static void bench_burst_wake(int rqs) {
+    ll_head *rqll;
+    RunQueue *rq = bench_setup(&rqll, 0);
+    RunQueue *extra[BURST_RQS];
+
+    for (int i = 1; i < rqs; i++) extra[i] = scheduler_new_rq_(rqll);
+    extra[0] = rq;
+
+    for (int i = 0; i < BURST_TASKS; i++)
+        schedule(extra[i % rqs], 2, 0, job_burst, NULL);
+
+    milliseconds_t due = TIMER_NOW_MS + 2;
+    while (TIMER_NOW_MS < due) time_update();
+
+    uint64_t start = now_us();
+    int woken = scheduler_wake_tasks();
+    uint64_t end = now_us();
+
+    g_dispatched = 0;
+    schedule_run(rqll);
+
+    report("burst_wake", rqs, "woken", woken);
+    report("burst_wake", rqs, "ns_per_task", (end - start) * 1000.0 / BURST_TASKS);
+
+    bench_teardown(rqll, rq);
+    for (int i = 1; i < rqs; i++) rq_free(extra[i]);
+}
+
+// Frames of up to 4ms of work paced to PACER_RATE, spinning the last spin_us
+static void bench_pacer(int spin_us) {
+    TimeJitter jit;
+    uint32_t seed = 1;
+
+    time_init(PACER_RATE);
+    time_set_spin_us(spin_us);
+    time_jitter_reset();
+
+    uint64_t start = now_us();
+
+    for (int i = 0; i < PACER_FRAMES; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint64_t work_end = now_us() + (seed >> 16) % 4000;
+
+        while (now_us() < work_end);
+
+        time_synchronize();
+    }
+
+    uint64_t elapsed = now_us() - start;
+    int64_t expected = (int64_t) PACER_FRAMES * 1000000 / PACER_RATE;
+
+    time_jitter(&jit);
+    time_set_spin_us(0);
+
+    report("pacer", spin_us, "p50_us", time_jitter_percentile(&jit, 50));
+    report("pacer", spin_us, "p99_us", time_jitter_percentile(&jit, 99));
+    report("pacer", spin_us, "max_us", jit.max_ns / 1000.0);
+    report("pacer", spin_us, "overruns", jit.overruns);
+    report("pacer", spin_us, "drift_us", (int64_t) elapsed - expected);
+}
+
+/* Soak */
+typedef struct SoakTask {
+    milliseconds_t period, last;
+    uint64_t runs;
+} SoakTask;
+
+static SoakTask g_soak[SOAK_TASKS];
+static milliseconds_t g_soak_end, g_soak_killed, g_soak_runtime;
+static uint64_t g_soak_errors, g_soak_ticks[SOAK_ENTITIES];
+static IPQueue64 *g_soak_entities;
+static IHeapNode g_soak_nodes[SOAK_ENTITIES];
+
+static void soak_error(const char *what, milliseconds_t expected) {
+    if (g_soak_errors++ < 8)
+        printf("soak: %s at %" PRIu64 "ms, expected %" PRIu64 "ms\n",
+                what, TIMER_NOW_MS, expected);
+}
+
+// Every run has to land exactly one period after the previous one
+static int job_soak_periodic(Task *task, Stack64 *st) {
+    SoakTask *s = g_soak + (uintptr_t) st;
+
+    if (s->runs && TIMER_NOW_MS != s->last + s->period)
+        soak_error("periodic task out of phase", s->last + s->period);
+
+    s->last = TIMER_NOW_MS;
+    s->runs++;
+
+    if (g_soak_end <= TIMER_NOW_MS) tk_kill(task);
+
+    return 0;
+}
+
+static int job_soak_sleeper(Task *task, Stack64*) {
+    if (task->extra++ && TIMER_NOW_MS != task->next_run)
+        soak_error("long sleep ended late", task->next_run);
+
+    if (g_soak_end <= TIMER_NOW_MS + SOAK_SLEEP_MS) tk_kill(task);
+    else tk_sleep(task, SOAK_SLEEP_MS);
+
+    return 0;
+}
+
+static int job_soak_doomed(Task *task, Stack64*) {
+    tk_sleep(task, 3600 * 1000);
+
+    return 0;
+}
+
+static void cb_soak_doomed(Task*) {
+    g_soak_killed = TIMER_NOW_MS;
+}
+
+// Re-weights due nodes in place the way game_update() ticks entities
+static int job_soak_entities(Task *task, Stack64*) {
+    while (ipq_peek_weight(g_soak_entities) <= TIMER_NOW_MS) {
+        IHeapNode *node = ipq_peek(g_soak_entities);
+        int i = node - g_soak_nodes;
+
+        ipq_update(g_soak_entities, node, TIMER_NOW_MS + (100 + i * 37) * 10);
+        g_soak_ticks[i]++;
+    }
+
+    if (g_soak_end <= TIMER_NOW_MS) tk_kill(task);
+
+    return 0;
+}
+
+static int soak(int days) {
+    ll_head *rqll;
+    RunQueue *rq = bench_setup(&rqll, 1);
+
+    milliseconds_t start = TIMER_NOW_MS;
+    g_soak_end = start + days * SOAK_DAY_MS;
+    g_soak_runtime = days * SOAK_DAY_MS / 2;
+    g_soak_entities = ipq_init(1);
+
+    for (uintptr_t i = 0; i < SOAK_TASKS; i++) {
+        g_soak[i].period = 60000 * (i + 1) + i;
+        schedule_periodic(rq, g_soak[i].period, 0, job_soak_periodic, (Stack64*) i);
+    }
+
+    for (int i = 0; i < SOAK_ENTITIES; i++) {
+        ipq_node_init(g_soak_nodes + i);
+        ipq_enqueue(g_soak_entities, g_soak_nodes + i, start);
+    }
+
+    schedule(rq, 0, 0, job_soak_sleeper, NULL);
+    schedule_cb(rq, 0, g_soak_runtime, job_soak_doomed, NULL, cb_soak_doomed);
+    schedule_periodic(rq, SOAK_ENTITY_MS, 0, job_soak_entities, NULL);
+
+    uint64_t wall = now_us();
+    schedule_run(rqll);
+    wall = now_us() - wall;
+
+    if (g_soak_killed != start + g_soak_runtime)
+        soak_error("runtime deadline", start + g_soak_runtime);
+
+    for (int i = 0; i < SOAK_TASKS; i++) {
+        // Once right away, then until the first run at or past the end
+        milliseconds_t period = g_soak[i].period;
+        uint64_t expected = (g_soak_end - start + period - 1) / period + 1;
+
+        if (g_soak[i].runs != expected)
+            printf("soak: task %d ran %" PRIu64 " times, expected %" PRIu64 "\n",
+                    i, g_soak[i].runs, expected);
+
+        g_soak_errors += g_soak[i].runs != expected;
+    }
+
+    // An entity is due again after its speed, then waits for the next job run
+    uint64_t ticks = 0;
+
+    for (int i = 0; i < SOAK_ENTITIES; i++) {
+        milliseconds_t every = (100 + i * 37) * 10 + SOAK_ENTITY_MS;
+
+        if (g_soak_ticks[i] < (g_soak_end - start) / every)
+            soak_error("entity stalled", i);
+
+        ticks += g_soak_ticks[i];
+    }
+
+    report("soak", days, "start_ms", start);
+    report("soak", days, "end_ms", TIMER_NOW_MS);
+    report("soak", days, "crossed_u32_ms", start <= UINT32_MAX && UINT32_MAX < TIMER_NOW_MS);
+    report("soak", days, "entity_ticks", ticks);
+    report("soak", days, "wall_ms", wall / 1000.0);
+    report("soak", days, "errors", g_soak_errors);
+
+    ipq_free(g_soak_entities);
+    bench_teardown(rqll, rq);
+
+    return g_soak_errors != 0;
+}
+
+int main(int argc, const char **argv) {
+    if (1 < argc && strcmp(argv[1], "soak") == 0) {
+        g_out = fopen("/dev/null", "w");
+        return soak(2 < argc ? atoi(argv[2]) : SOAK_DAYS);
+    }
+
+    const char *path = 1 < argc ? argv[1] : BENCH_OUTPUT;
+    int max_tasks = 2 < argc ? atoi(argv[2]) : BENCH_TASKS_MAX;
+
+    g_out = fopen(path, "w");
+
+    if (g_out == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    fprintf(g_out, "bench,tasks,metric,value\n");
+
+    for (int n = 10; n <= max_tasks; n *= 10) {
+        bench_dispatch(n);
+        bench_wakeup(n);
+        bench_burst_heap(n);
+    }
+
+    bench_burst_wake(1);
+    bench_burst_wake(BURST_RQS);
+
+    bench_pacer(0);
+    bench_pacer(PACER_SPIN_US);
+
+    fclose(g_out);
+
+    printf("\nWrote %s\n", path);
+
+    return 0;
+}
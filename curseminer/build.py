@@ -6,7 +6,7 @@ from pathlib import Path
 CWD = os.getcwd()
 
 CC =            'gcc'
-CF_LIBS =       '-lncurses -lm -ldl -lSDL2'
+CF_LIBS =       '-lncurses -lm -ldl -lpthread -lSDL2 -rdynamic'
 CF_SDL2 =       subprocess.check_output('sdl2-config --cflags', shell=True, text=True).strip()
 LIBS_SDL2 =     subprocess.check_output('sdl2-config --libs', shell=True, text=True).strip()
 
@@ -20,10 +20,18 @@ EXCLUDE =       [f'{SRCDIR}/frontends/esp32s3-waveshare.c']
 
 TARGET =        os.path.basename(CWD)
 
+BENCHDIR =      './bench'
+BENCH_OBJDIR =  './obj_bench'
+BENCH_TARGET =  'sched_bench'
+BENCH_OUTPUT =  f'{BENCH_OBJDIR}/bench_output.txt'
+BENCH_SOURCES = [f'{SRCDIR}/{f}' for f in ['scheduler.c', 'trace.c', 'watchdog.c', 'parallel.c', 'stack64.c', 'time.c', 'arch.c']]
+BENCH_LIBS =    '-lm -ldl -lpthread'
+
 INCPATHS =      ' '.join([f'-I{incdir}' for incdir in INCDIRS])
 CF =            f'{LIBS_SDL2} {CF_SDL2} {CF_LIBS} {INCPATHS}'
 CF_DEBUG =      f'-Wall -g -DDEBUG'
 CF_OPTIM =      f'-O3'
+CF_BENCH =      f'{CF_OPTIM} -Wall'
 
 
 def get_all_files(dirs, ext, max_depth=None):
@@ -115,8 +123,8 @@ def source_modified(src, obj):
     return srcmt > objmt
 
 
-def build_obj(srcfile, extra_cflags, dry=False):
-    objfile = f'{OBJDIR}/' + '.'.join(srcfile.split('.')[:-1]) + '.o'
+def build_obj(srcfile, extra_cflags, dry=False, objdir=OBJDIR):
+    objfile = f'{objdir}/' + '.'.join(srcfile.split('.')[:-1]) + '.o'
     ensure_path_exists(objfile)
 
     cflags = f'{INCPATHS} {CF_SDL2} -c -o {objfile}'.split(' ')
@@ -150,6 +158,31 @@ def build_exe(extra_cflags=None, dry=False):
         return subprocess.Popen(cmd)
 
 
+# Scheduler benchmarks only need the scheduler and its dependencies
+def build_bench(dry=False, args=[BENCH_OUTPUT]):
+    processes = []
+    sources = BENCH_SOURCES + get_all_files([BENCHDIR], '.c')
+
+    for src in sources:
+        # -Wextra only for the benchmarks, the game sources aren't clean yet
+        cflags = CF_BENCH if src in BENCH_SOURCES else f'{CF_BENCH} -Wextra'
+        proc = build_obj(src, cflags.split(' '), dry=dry, objdir=BENCH_OBJDIR)
+
+        if proc:
+            processes.append(proc)
+
+    for proc in processes:
+        proc.wait()
+
+    objfiles = get_all_files([BENCH_OBJDIR], '.o')
+    cmd = [CC, *objfiles, *BENCH_LIBS.split(' '), '-o', BENCH_TARGET]
+
+    print(' '.join(cmd))
+    if not dry:
+        subprocess.Popen(cmd).wait()
+        return subprocess.Popen([f'./{BENCH_TARGET}', *args]).wait()
+
+
 if __name__ == '__main__':
     from sys import argv
     
@@ -177,9 +210,18 @@ if __name__ == '__main__':
             if proc:
                 processes.append(proc)
 
+    elif mode == 'bench':
+        build_bench(dry=dry_run)
+        exit(0)
+
+    elif mode == 'soak':
+        exit(build_bench(dry=dry_run, args=['soak', *argv[2:]]) or 0)
+
     elif mode == 'clean':
         remove_path(OBJDIR)
         remove_path(TARGET)
+        remove_path(BENCH_OBJDIR)
+        remove_path(BENCH_TARGET)
         
         remove_files(get_all_files(['./'], '.log'))
         exit(0)
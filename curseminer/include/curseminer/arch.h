@@ -4,6 +4,44 @@
 #include "curseminer/time.h"
 
 int arch_sleep(TimeStamp*);
+int arch_sleep_until(TimeStamp*, int fd);
 void arch_get_time_monotonic(TimeStamp*);
+void arch_get_time_thread_cpu(TimeStamp*);
+
+// Cheap 64-bit monotonic nanoseconds, TSC based where possible
+int arch_fast_clock_init();
+uint64_t arch_fast_clock_ns();
+
+int arch_wakeup_fd_init();
+void arch_wakeup_fd_signal(int fd);
+void arch_wakeup_fd_clear(int fd);
+
+int arch_cpu_count();
+
+// Writes the name of the function containing addr, or addr itself, into buf
+void arch_symbol_name(const void *addr, char *buf, int n);
+
+// Installs handler for the user signal, returns -1 where there is none
+int arch_on_user_signal(void (*handler)(int));
+
+
+/* Readiness notification for file descriptors, backed by epoll on Linux.
+ * Registrations are level triggered and stay until removed.
+ */
+#define ARCH_POLL_IN    0x01
+#define ARCH_POLL_OUT   0x02
+#define ARCH_POLL_ERR   0x04
+#define ARCH_POLL_HUP   0x08
+
+typedef struct ArchPollEvent {
+    void *data;
+    unsigned int events;
+} ArchPollEvent;
+
+int arch_poller_init();
+void arch_poller_free(int poller);
+int arch_poller_add(int poller, int fd, unsigned int events, void *data);
+int arch_poller_del(int poller, int fd);
+int arch_poller_wait(int poller, TimeStamp *deadline, ArchPollEvent*, int max);
 
 #endif
@@ -5,10 +5,12 @@
 
 #include "curseminer/stack64.h"
 #include "curseminer/scheduler.h"
+#include "curseminer/framegraph.h"
 #include "curseminer/frontend.h"
 #include "curseminer/world.h"
 
 #define GAME_REFRESH_RATE 20
+#define GAME_REFRESH_SLACK_MS 8
 #define E_MOD_CROUCHING E_MOD_0
 #define TILE_BREAK_DISTANCE 10
 
@@ -83,6 +85,11 @@ typedef struct GameContext {
     byte_t *cache_world;
     DirtyFlags *cache_dirty_flags;
 
+    // Jobs run by game_update() each frame, including the frontend's
+    FrameGraph *frame;
+    int frame_tick, frame_update, frame_rate;
+    milliseconds_t frame_slack_ms;
+
     int (*f_init)(struct GameContext*, int);
     int (*f_update)();
     int (*f_exit)();
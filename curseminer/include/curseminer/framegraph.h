@@ -0,0 +1,51 @@
+#ifndef H_CURSEMINER_FRAMEGRAPH
+#define H_CURSEMINER_FRAMEGRAPH
+
+#include <inttypes.h>
+
+#include "curseminer/scheduler.h"
+
+#define FG_NODES_MAX 32
+
+// Node may run on a parallel pool thread, see parallel_for()
+#define FG_NODE_PARALLEL 0x01
+
+/* Frame Graph
+ * Jobs of one frame and their dependencies. Each run executes the jobs level
+ * by level in topological order, a level being every job whose dependencies
+ * are all in earlier levels. FG_NODE_PARALLEL jobs of a level run on the
+ * parallel pool while the rest run on the caller by id, so jobs of a level
+ * must not share state. A job may only run every nth frame, see fg_every(),
+ * which lets jobs with different rates share one graph.
+ */
+typedef struct FrameNode {
+    const char *name;
+    void (*func)(void*);
+    void *ctx;
+    uint32_t after;
+    int flags;
+    unsigned int every, level;
+    uint64_t last_us, max_us;
+} FrameNode;
+
+typedef struct FrameGraph {
+    FrameNode nodes[FG_NODES_MAX];
+    int count, levels, compiled;
+
+    // Node ids sorted by level, level i spans order[start[i]..start[i+1])
+    unsigned char order[FG_NODES_MAX], start[FG_NODES_MAX + 1];
+
+    uint64_t frames, last_us;
+} FrameGraph;
+
+FrameGraph *fg_init();
+void fg_free(FrameGraph*);
+int fg_add(FrameGraph*, const char *name, void (*func)(void*), void *ctx, int flags);
+int fg_depend(FrameGraph*, int node, int after);
+int fg_every(FrameGraph*, int node, unsigned int n);
+int fg_compile(FrameGraph*);
+int fg_run(FrameGraph*);
+uint64_t fg_critical_path_us(FrameGraph*);
+int fg_schedule(FrameGraph*, RunQueue*, milliseconds_t period, milliseconds_t slack);
+
+#endif
@@ -6,6 +6,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "curseminer/framegraph.h"
+
 typedef enum {
     E_TYPE_NULL,
     E_TYPE_KB,
@@ -108,6 +110,7 @@ typedef int (*frontend_init_ui_t)(Frontend*, const char*);
 typedef void (*frontend_exit_ui_t)(Frontend*);
 typedef int (*frontend_init_input_t)(Frontend*);
 typedef void (*frontend_exit_input_t)(Frontend*);
+typedef int (*frontend_frame_init_t)(FrameGraph*, int tick, int update);
 
 typedef struct Frontend {
     int width, height;
@@ -125,6 +128,15 @@ typedef struct Frontend {
 
     bool (*f_set_glyphset)  (const char *name);
 
+    /* Frame Graph
+     * Adds the frontend's jobs, such as input drain, render and present, to
+     * each game's frame graph, ordered around its entity tick and update
+     * nodes. The graph then runs refresh_rate times per second with
+     * refresh_slack_ms of slack, or at the game's rate if that is higher.
+     */
+    frontend_frame_init_t f_frame_init;
+    int refresh_rate, refresh_slack_ms;
+
 } Frontend;
 
 typedef struct {
@@ -142,9 +154,11 @@ int frontend_register_ui(frontend_init_ui_t, frontend_exit_ui_t);
 int frontend_register_input(frontend_init_input_t, frontend_exit_input_t);
 
 int frontend_init(const char* title);
+int frontend_frame_init(FrameGraph*, int tick, int update, milliseconds_t *slack);
 void frontend_exit();
 
 int frontend_register_event(event_t, event_ctx_t, void (*)(InputEvent*));
 void frontend_dispatch_event(event_ctx_t, InputEvent*);
+int frontend_post_event(event_ctx_t, InputEvent*);
 
 #endif
@@ -8,4 +8,6 @@ void frontend_headless_ui_exit(Frontend*);
 int frontend_headless_input_init(Frontend*);
 void frontend_headless_input_exit(Frontend*);
 
+void frontend_headless_set_dump(milliseconds_t period);
+
 #endif
@@ -0,0 +1,31 @@
+#ifndef H_CURSEMINER_PARALLEL
+#define H_CURSEMINER_PARALLEL
+
+#include <inttypes.h>
+
+#define PARALLEL_THREADS_MAX 16
+#define PARALLEL_CHUNKS_MAX 1024
+
+/* Data parallel loops
+ * [begin, end) is split into chunks of at least grain iterations which run on
+ * a fixed pool of threads and on the caller, which returns once all of them
+ * are done. Chunks must not touch state shared with other chunks or with
+ * tasks. Everything runs inline on the caller on single core targets, when the
+ * range fits in one chunk, when called from a chunk or while another thread
+ * has the pool.
+ */
+typedef void (*parallel_for_t)(int64_t begin, int64_t end, void *ctx);
+typedef uint64_t (*parallel_map_t)(int64_t begin, int64_t end, void *ctx);
+typedef uint64_t (*parallel_join_t)(uint64_t, uint64_t);
+
+int parallel_init(int threads);
+void parallel_free();
+int parallel_threads();
+
+void parallel_for(int64_t begin, int64_t end, int64_t grain, parallel_for_t, void *ctx);
+void parallel_for_with(int64_t begin, int64_t end, int64_t grain, parallel_for_t,
+        void *ctx, void (*serial)(void*), void *serial_ctx);
+uint64_t parallel_reduce(int64_t begin, int64_t end, int64_t grain,
+        uint64_t identity, parallel_map_t, parallel_join_t, void *ctx);
+
+#endif
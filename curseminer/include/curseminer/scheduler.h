@@ -1,21 +1,30 @@
 #ifndef RUN_QUEUE_HEADER
 #define RUN_QUEUE_HEADER
 
+#include <pthread.h>
+#include <stdio.h>
+
 #include "curseminer/time.h"
 #include "curseminer/stack64.h"
 
 #define RQ_MEMPOOL_SIZE 4096 * 1
+#define SCHEDULER_WORKERS_MAX 16
+#define RQ_INBOX_SIZE 256 // Must be a power of two
+#define RQ_AGING_FRAMES 4 // Cut off frames before a priority class runs first
+#define RQ_DEADLINE_SLACK_MS 8 // Later than this after next_run is a miss
+#define RQ_WEIGHT_DEFAULT 1024
+#define RQ_VRUNTIME_SLACK_US 20000 // How far an idle RunQueue may fall behind
 
 typedef unsigned char byte_t;
 
-const extern unsigned char RQ_FLAG_BIT;
-const extern unsigned char RQ_FLAG_KILLED;
-const extern unsigned char RQ_FLAG_SLEEPING;
-const extern unsigned char RQ_FLAG_NEW;
-const extern unsigned char RQ_FLAG_RAN;
-const extern unsigned char RQ_FLAG_CHANGED;
-const extern unsigned char RQ_FLAG_PARAMS;
-const extern unsigned char RQ_FLAG_CUSTOM2;
+extern const unsigned char RQ_FLAG_BIT;
+extern const unsigned char RQ_FLAG_KILLED;
+extern const unsigned char RQ_FLAG_SLEEPING;
+extern const unsigned char RQ_FLAG_NEW;
+extern const unsigned char RQ_FLAG_RAN;
+extern const unsigned char RQ_FLAG_CHANGED;
+extern const unsigned char RQ_FLAG_PARAMS;
+extern const unsigned char RQ_FLAG_CUSTOM2;
 
 extern unsigned int GLOBAL_TASK_COUNT;
 
@@ -39,6 +48,26 @@ int ll_full(ll_head*);
 void ll_free(ll_head*);
 
 
+/* Per task accounting, only recorded while scheduler_set_task_stats() is on.
+ * Lateness is how long after its next_run a sleeping task actually ran.
+ */
+typedef struct TaskStats {
+    uint64_t calls, total_us, wakes, late_total_us;
+    microseconds_t max_us, max_late_us;
+    unsigned int misses;
+} TaskStats;
+
+
+/* Priority classes, within a frame every runnable task of a higher class runs
+ * before those of lower ones */
+typedef enum {
+    TK_PRIO_HIGH,
+    TK_PRIO_NORMAL,
+    TK_PRIO_LOW,
+    TK_PRIO_C,
+} tk_prio_t;
+
+
 /* Task */
 struct RunQueue;
 typedef struct Task {
@@ -49,25 +78,200 @@ typedef struct Task {
     struct RunQueue *runqueue;
     Stack64 *stack;
     milliseconds_t next_run, kill_time;
+    unsigned int epoch, resume;
+    TimerNode timer;
+    IHeapNode deadline;
+
+    // fd the task is parked on, -1 if none. revents holds ARCH_POLL_* bits
+    int wait_fd;
+    unsigned int events, revents, reactor;
+
+    // Bumped every time the slot is freed, see TaskHandle
+    unsigned int gen;
+
+    // Future or join the task is blocked on
+    byte_t blocked;
+    struct Task *wnext, **wlist, *joiners;
+
+    // Shown by introspection, see scheduler_task_info()
+    const char *name;
+    byte_t woken, prio;
+    TaskStats stats;
+
+    // Periodic tasks run every period ms from anchor, up to slack ms late
+    milliseconds_t period, slack, anchor;
 
     struct Task* next;
 } Task;
 
 void tk_sleep(Task*, milliseconds_t);
+int tk_wait_fd(Task*, int fd, unsigned int events);
 int tk_kill(Task*);
 int tk_kill_all();
+void tk_set_name(Task*, const char*);
+void tk_set_priority(Task*, tk_prio_t);
+void tk_set_period(Task*, milliseconds_t period, milliseconds_t slack);
+
+
+/* Task slots are reused, a handle only refers to the task it was created for
+ * as long as the generation matches */
+typedef struct TaskHandle {
+    Task *task;
+    unsigned int gen;
+} TaskHandle;
+
+TaskHandle tk_handle(Task*);
+int tk_alive(TaskHandle);
+int tk_join(Task*, TaskHandle, milliseconds_t timeout);
+
+
+/* Future
+ * Single value set by one task and awaited by any number of others. The
+ * memory is owned by the caller and must outlive all waiters.
+ */
+typedef struct Future {
+    uint64_t value;
+    int ready;
+    Task *waiters;
+} Future;
+
+#define FUTURE_INIT {0, 0, NULL}
+
+void fut_init(Future*);
+void fut_set(Future*, uint64_t);
+void fut_reset(Future*);
+int fut_ready(Future*);
+uint64_t fut_get(Future*);
+int tk_await(Task*, Future*, milliseconds_t timeout);
+
+
+/* Coroutine Tasks
+ * Stackless resume points for Task.func, so a long job can give up the CPU
+ * and continue where it left off on its next run. Locals do not survive a
+ * yield, keep state in Stack64. A switch statement may not span a yield.
+ *
+ *   int job(Task *tk, Stack64 *st) {
+ *       TK_BEGIN(tk);
+ *       while (work_left(st)) {
+ *           do_slice(st);
+ *           TK_YIELD(tk);
+ *       }
+ *       TK_SLEEP(tk, 100);
+ *       TK_AWAIT(tk, ready(st));
+ *       TK_END(tk);
+ *   }
+ */
+#define TK_BEGIN(tk) switch ((tk)->resume) { case 0:
+
+// Resume points are numbered with __COUNTER__ so several fit on one line
+#define TK_POINT_(tk, n) (tk)->resume = (n); case (n):
+
+// Return to the scheduler, resume after this point on the next run
+#define TK_YIELD(tk) TK_YIELD_(tk, __COUNTER__ + 1)
+#define TK_YIELD_(tk, n) do {                                               \
+        (tk)->resume = (n); return 0; case (n):;                            \
+    } while (0)
+
+#define TK_SLEEP(tk, ms) do {                                               \
+        tk_sleep((tk), (ms)); TK_YIELD(tk);                                 \
+    } while (0)
+
+// Yields once per pass until cond holds
+#define TK_AWAIT(tk, cond) TK_AWAIT_(tk, cond, __COUNTER__ + 1)
+#define TK_AWAIT_(tk, cond, n) do {                                         \
+        TK_POINT_(tk, n)                                                    \
+        if (!(cond)) return 0;                                              \
+    } while (0)
+
+// Same as TK_AWAIT but only checks cond every ms milliseconds
+#define TK_AWAIT_MS(tk, cond, ms) TK_AWAIT_MS_(tk, cond, ms, __COUNTER__ + 1)
+#define TK_AWAIT_MS_(tk, cond, ms, n) do {                                  \
+        TK_POINT_(tk, n)                                                    \
+        if (!(cond)) { tk_sleep((tk), (ms)); return 0; }                    \
+    } while (0)
+
+// Blocks until the future is set or the task behind the handle is gone
+#define TK_AWAIT_FUTURE(tk, fut) do {                                       \
+        if (!tk_await((tk), (fut), 0)) TK_YIELD(tk);                        \
+    } while (0)
+
+#define TK_JOIN(tk, handle) do {                                            \
+        if (!tk_join((tk), (handle), 0)) TK_YIELD(tk);                      \
+    } while (0)
+
+#define TK_END(tk) } (tk)->resume = 0; tk_kill(tk); return 0
+
+
+/* Tasks are allocated from page sized slabs which are never moved or freed
+ * while the RunQueue lives, so Task pointers stay valid */
+typedef struct TaskSlab {
+    struct TaskSlab *next;
+    Task tasks[];
+} TaskSlab;
+
+
+/* Requests submitted to a RunQueue from outside its worker, see rq_inject() */
+typedef struct RQInjection {
+    unsigned int seq;
+    milliseconds_t delay, runtime;
+    int (*func)(Task*, Stack64*);
+    Stack64 *stack;
+    void (*callback)(Task*);
+    void (*call)(uint64_t, uint64_t);
+    uint64_t args[2];
+} RQInjection;
+
+typedef struct RQInbox {
+    unsigned int head, tail;
+    RQInjection cells[RQ_INBOX_SIZE];
+} RQInbox;
 
 
 /* RunQueue*/
 typedef struct RunQueue {
-    Task *mempool, *head, *tail;
+    TaskSlab *slabs;
+    Task *free;
+
+    /* One circular list per priority class. The first pass[c] tasks of a
+     * list have yet to run in the current frame */
+    Task *head[TK_PRIO_C], *tail[TK_PRIO_C];
+    unsigned int queued[TK_PRIO_C], pass[TK_PRIO_C], starved[TK_PRIO_C];
+    int boost;
+
+    // Task whose Task.func is running, it is on none of the lists meanwhile
+    Task *current;
+
+    // Runs which started later than RQ_DEADLINE_SLACK_MS after next_run
+    unsigned int misses[TK_PRIO_C];
     struct RunQueue *next;
+    ll_head *rqll;
+    RQInbox *inbox;
 
+    pthread_mutex_t mutex;
     unsigned int count, max, running;
-    int lock;
+    int lock, pinned;
+
+    // Per frame time allowance, 0 means unlimited
+    microseconds_t budget_us;
+    int64_t debt_us;
+    unsigned int overruns;
+
+    // Runtime scaled by RQ_WEIGHT_DEFAULT / weight, the lowest runs first
+    unsigned int weight, frame;
+    uint64_t vruntime;
+
+    // Unique for the process' lifetime, used as the pid in traces
+    unsigned int id;
 } RunQueue;
 
 int rq_kill(RunQueue*);
+int rq_inject(RunQueue*, milliseconds_t, milliseconds_t, int (*func)(Task*, Stack64*), Stack64*, void (*callback)(Task*));
+int rq_inject_call(RunQueue*, void (*call)(uint64_t, uint64_t), uint64_t, uint64_t);
+void rq_free(RunQueue*);
+int rq_pin(RunQueue*, ll_head*);
+void rq_set_budget(RunQueue*, microseconds_t);
+void rq_set_weight(RunQueue*, unsigned int);
+void rq_unpin(RunQueue*);
 
 
 /* Linked List of run queues*/
@@ -79,17 +283,53 @@ typedef struct RunQueueList {
 int rqll_kill(ll_head*);
 
 
+/* Idle accounting, only passes in which no task ran count as idle */
+typedef struct SchedulerIdleStats {
+    uint64_t idle_us, idle_cpu_us, wakeups, cpu_ms_per_idle_hour;
+} SchedulerIdleStats;
+
+
+/* Introspection snapshot of one live task */
+typedef struct TaskInfo {
+    Task *task;
+    struct RunQueue *runqueue;
+    unsigned int worker;
+    const char *name;
+    int (*func)(Task*, Stack64*);
+    byte_t flags, prio;
+    char state;
+    milliseconds_t next_run;
+    TaskStats stats;
+} TaskInfo;
+
+
 /* Scheduler Functions */
 ll_head *scheduler_init();
 void scheduler_free();
 RunQueue* scheduler_new_rq();
 RunQueue* scheduler_new_rq_(ll_head* rqll);
-RunQueueList *scheduler_new_rqll();
+ll_head *scheduler_new_rqll();
 int scheduler_wake_tasks();
 int scheduler_kill_all_tasks();
+void scheduler_set_tickless(int);
+void scheduler_set_virtual(int);
+int scheduler_set_rqll_budget(ll_head*, microseconds_t);
+unsigned int scheduler_rqll_overruns(ll_head*);
+void scheduler_wakeup();
+void scheduler_idle_stats(SchedulerIdleStats*);
+void scheduler_set_task_stats(int);
+int scheduler_task_stats_enabled();
+int scheduler_task_info(TaskInfo*, int max);
+void scheduler_sort_task_info(TaskInfo*, int);
+void scheduler_dump_tasks(FILE*);
+uint64_t scheduler_worker_running(unsigned int worker,
+        int (**func)(Task*, Stack64*), const char **name);
 
-int schedule(RunQueue*, int, int, int (*func)(Task*, Stack64*), Stack64*);
-int schedule_cb(RunQueue*, int, int, int (*func)(Task*, Stack64*), Stack64*, void (*callback)(Task*));
+int schedule(RunQueue*, milliseconds_t, milliseconds_t, int (*func)(Task*, Stack64*), Stack64*);
+int schedule_cb(RunQueue*, milliseconds_t, milliseconds_t, int (*func)(Task*, Stack64*), Stack64*, void (*callback)(Task*));
+int schedule_periodic(RunQueue*, milliseconds_t, milliseconds_t, int (*func)(Task*, Stack64*), Stack64*);
+int schedule_named(RunQueue*, const char *name, milliseconds_t, milliseconds_t, int (*func)(Task*, Stack64*), Stack64*, void (*callback)(Task*));
+TaskHandle schedule_handle(RunQueue*, milliseconds_t, milliseconds_t, int (*func)(Task*, Stack64*), Stack64*, void (*callback)(Task*));
 void schedule_run(ll_head*);
 
 #endif
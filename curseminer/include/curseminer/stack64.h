@@ -3,6 +3,7 @@
 
 #include "stdlib.h"
 #include "stdint.h"
+#include "stddef.h"
 
 
 /* 8 Byte Stack */
@@ -81,7 +82,7 @@ Heap *minh_init(int pages);
 void minh_print(Heap*, char);
 int minh_insert(Heap*, uint64_t, uint64_t);
 uint64_t minh_get(Heap*, int);
-uint64_t *minh_delete(Heap*, int);
+uint64_t minh_delete(Heap*, int);
 uint64_t minh_pop(Heap*);
 
 
@@ -103,4 +104,68 @@ int pq_full(PQueue64*);
 int pq_clear(PQueue64*);
 void pq_free(PQueue64*);
 
+
+/* Indexed Priority Queue
+ * D-ary min heap of nodes embedded in the queued structs. Every node knows
+ * its position in the heap so it can be removed or re-weighted in O(log n).
+ */
+#define IPQ_D 4
+
+typedef struct IHeapNode {
+    uint64_t weight;
+    int index;
+} IHeapNode;
+
+typedef struct IPQueue64 {
+    IHeapNode **mempool;
+    int count, capacity;
+} IPQueue64;
+
+#define ipq_entry(node, type, member) \
+    ((type*) ((char*) (node) - offsetof(type, member)))
+
+IPQueue64 *ipq_init(int pages);
+void ipq_node_init(IHeapNode*);
+int ipq_enqueue(IPQueue64*, IHeapNode*, uint64_t weight);
+int ipq_remove(IPQueue64*, IHeapNode*);
+int ipq_update(IPQueue64*, IHeapNode*, uint64_t weight);
+IHeapNode *ipq_dequeue(IPQueue64*);
+int ipq_dequeue_until(IPQueue64*, uint64_t weight, IHeapNode **out, int max);
+IHeapNode *ipq_peek(IPQueue64*);
+uint64_t ipq_peek_weight(IPQueue64*);
+IHeapNode *ipq_get(IPQueue64*, int);
+int ipq_queued(IHeapNode*);
+int ipq_empty(IPQueue64*);
+int ipq_clear(IPQueue64*);
+void ipq_free(IPQueue64*);
+
+
+/* Hierarchical Timer Wheel */
+#define TW_LEVELS 4
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+
+typedef struct TimerNode {
+    struct TimerNode *next, *prev;
+    uint64_t expiry, data;
+} TimerNode;
+
+typedef struct TimerWheel {
+    TimerNode slots[TW_LEVELS][TW_SLOTS], overflow;
+    uint64_t now;
+    int count;
+} TimerWheel;
+
+TimerWheel *tw_init(uint64_t now);
+void tw_list_init(TimerNode*);
+void tw_insert(TimerWheel*, TimerNode*, uint64_t expiry, uint64_t data);
+void tw_cancel(TimerWheel*, TimerNode*);
+int tw_pending(TimerNode*);
+int tw_advance(TimerWheel*, uint64_t now, TimerNode *expired);
+int tw_expire_all(TimerWheel*, TimerNode *expired);
+uint64_t tw_next_expiry(TimerWheel*);
+int tw_empty(TimerWheel*);
+void tw_free(TimerWheel*);
+
 #endif
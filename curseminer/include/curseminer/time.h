@@ -2,40 +2,81 @@
 #define TIMER_HEADER
 
 #include <inttypes.h>
+#include <stdio.h>
 #include <time.h>
 
-typedef uint32_t nanoseconds_t;
+/* Points in time are 64-bit and never wrap in practice, durations which are
+ * known to be short may be kept in microseconds_t */
+typedef uint64_t nanoseconds_t;
 typedef uint32_t microseconds_t;
-typedef uint32_t milliseconds_t;
+typedef uint64_t milliseconds_t;
 typedef time_t seconds_t;
 
 typedef struct TimeStamp {
-    nanoseconds_t usec;
+    microseconds_t usec;
     seconds_t sec;
 } TimeStamp;
 
+// Signed a - b, e.g. how late a timer ran. Timestamps never wrap, < orders them
+#define time_ms_delta(a, b) ((int64_t) ((milliseconds_t) (a) - (milliseconds_t) (b)))
+
+#define TIME_JITTER_BUCKETS 18
+
+/* How late frames and paced sleeps started past their absolute targets.
+ * buckets[0] counts the ones on time to the microsecond, buckets[i] those
+ * 2^(i-1) to 2^i us late and the last bucket everything later. Overruns are
+ * frames that took longer than their period, skipped ones fell so far behind
+ * the pacer dropped the missed frames.
+ */
+typedef struct TimeJitter {
+    uint64_t frames, overruns, skipped;
+    nanoseconds_t total_ns, max_ns;
+    uint64_t buckets[TIME_JITTER_BUCKETS];
+} TimeJitter;
+
 // TODO: move to globals
 extern TimeStamp INIT_TIME;
-extern TimeStamp TIMER_NOW;
 extern TimeStamp TIMER_NEVER;
 extern milliseconds_t INIT_TIME_MS;
-extern milliseconds_t TIMER_NOW_MS;
 extern milliseconds_t TIMER_NEVER_MS;
 
+/* Frame clock of the calling thread, only moved by time_update(),
+ * time_synchronize() and time_set_now(). Threads outside the scheduler have
+ * to call one of them before reading it.
+ */
+extern _Thread_local TimeStamp TIMER_NOW;
+extern _Thread_local milliseconds_t TIMER_NOW_MS;
+extern _Thread_local nanoseconds_t TIMER_NOW_NS;
+
 void time_init(int);
 void time_synchronize();
+void time_update();
+void time_set_now(TimeStamp*);
+void time_set_virtual(int);
+int time_is_virtual();
+void time_advance_ms(milliseconds_t);
 
 void time_now(TimeStamp*);
+nanoseconds_t time_now_ns();
 void time_never(TimeStamp*);
 
 int time_ready(TimeStamp*);
 int time_nready(TimeStamp*);
 int time_sleep(TimeStamp*);
+int time_sleep_until(TimeStamp*, int fd);
+TimeStamp time_spin_start(TimeStamp*);
+void time_set_spin_us(microseconds_t);
+
+void time_jitter(TimeJitter*);
+void time_jitter_reset();
+microseconds_t time_jitter_percentile(TimeJitter*, int percent);
+void time_jitter_dump(FILE*);
 
 void time_print(TimeStamp*);
 void time_print_now();
 
 milliseconds_t time_to_ms(TimeStamp*);
+nanoseconds_t time_to_ns(TimeStamp*);
 TimeStamp time_diff(TimeStamp*, TimeStamp*);
 void time_add_ms(TimeStamp*, milliseconds_t);
 milliseconds_t time_diff_millisec(TimeStamp*, TimeStamp*);
@@ -0,0 +1,35 @@
+#ifndef H_CURSEMINER_TRACE
+#define H_CURSEMINER_TRACE
+
+#include <inttypes.h>
+
+#include "curseminer/scheduler.h"
+
+#define TRACE_RING_SIZE 4096 // Events kept per thread
+
+typedef enum {
+    TRACE_RUN,
+    TRACE_SLEEP,
+    TRACE_WAKE,
+    TRACE_KILL,
+} trace_event_t;
+
+/* Tracing
+ * Scheduler events go to a lock-free ring per thread and are written out as
+ * Chrome trace-event JSON. The scheduler calls trace_record() for every event
+ * while TRACE_ENABLED is set, trace_poll() once per worker frame and
+ * trace_free() from scheduler_free().
+ */
+extern int TRACE_ENABLED;
+
+uint64_t trace_now_us();
+void trace_record(trace_event_t, Task*, int worker, uint64_t ts_us, uint64_t dur_us);
+void trace_poll();
+void trace_free();
+
+int trace_start(const char *path);
+int trace_flush();
+void trace_request_flush();
+void trace_stop();
+
+#endif
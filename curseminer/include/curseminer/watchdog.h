@@ -0,0 +1,39 @@
+#ifndef H_CURSEMINER_WATCHDOG
+#define H_CURSEMINER_WATCHDOG
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "curseminer/scheduler.h"
+
+#define WATCHDOG_RING_SIZE 64
+
+/* Runs of Task.func which took longer than the threshold, or which the
+ * monitor thread caught still running after its stuck limit.
+ */
+typedef struct WatchdogEvent {
+    int (*func)(Task*, Stack64*);
+    const char *name;
+    struct RunQueue *runqueue;
+    unsigned int worker;
+    int stuck;
+    uint64_t start_us, took_us;
+} WatchdogEvent;
+
+/* Watchdog
+ * The scheduler times every run of Task.func while WATCHDOG_US or
+ * WATCHDOG_STUCK_MS is set and calls watchdog_record() for those which took
+ * at least WATCHDOG_US. The monitor thread reads what each worker is running
+ * through scheduler_worker_running().
+ */
+extern microseconds_t WATCHDOG_US;
+extern milliseconds_t WATCHDOG_STUCK_MS;
+
+void watchdog_record(Task*, unsigned int worker, uint64_t start_us, uint64_t took_us);
+
+void watchdog_set_threshold(microseconds_t);
+int watchdog_monitor(milliseconds_t stuck_ms);
+int watchdog_events(WatchdogEvent*, int max);
+void watchdog_dump(FILE*);
+
+#endif
@@ -14,6 +14,7 @@ typedef struct Entity {
     EntityType* type;
     Skin skin;
     EntityController* controller;
+    IHeapNode tick_node;
     milliseconds_t next_tick;
     int id, x, y, vx, vy, speed, health, facing, inventory_index;
     int *inventory;
@@ -58,7 +59,7 @@ typedef struct ChunkArena {
 
 typedef struct World {
     ChunkArena *chunk_arenas;
-    PQueue64 *entities;
+    IPQueue64 *entities;
                        
     int chunk_s, entity_c, entity_maxc, chunk_max;
     size_t chunk_mem_used, chunk_mem_stride, chunk_mem_max;
@@ -1,9 +1,26 @@
+#ifdef __linux__
+#define _GNU_SOURCE // For dladdr(), before any system header
+#endif
+
+#include <stdio.h>
+
 #include "curseminer/arch.h"
 
 
 #ifdef __linux__
+#include <dlfcn.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#ifdef __x86_64__
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 int arch_sleep(TimeStamp *ts) {
     uint64_t s = ts->sec;
@@ -12,6 +29,38 @@ int arch_sleep(TimeStamp *ts) {
     return usleep(us);
 }
 
+/* Blocks until the absolute monotonic deadline or until fd becomes readable.
+ * Returns 1 if woken up through fd, 0 otherwise.
+ */
+int arch_sleep_until(TimeStamp *deadline, int fd) {
+    struct timespec abs = {
+        .tv_sec = deadline->sec,
+        .tv_nsec = (long) deadline->usec * 1000,
+    };
+
+    if (0 <= fd) {
+        TimeStamp now;
+        arch_get_time_monotonic(&now);
+
+        int64_t us = (int64_t) (deadline->sec - now.sec) * 1000000
+                   + (int64_t) deadline->usec - (int64_t) now.usec;
+
+        // poll() only has millisecond resolution, the rest is slept below
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int timeout = us <= 0 ? 0 : us / 1000;
+
+        if (0 < poll(&pfd, 1, timeout)) {
+            uint64_t v;
+            read(fd, &v, sizeof(v));
+            return 1;
+        }
+    }
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &abs, NULL) != 0);
+
+    return 0;
+}
+
 void arch_get_time_monotonic(TimeStamp *ts) {
     struct timespec spec;
     clock_gettime(CLOCK_MONOTONIC, &spec);
@@ -23,6 +72,209 @@ void arch_get_time_monotonic(TimeStamp *ts) {
     ts->usec = usec;
 }
 
+void arch_get_time_thread_cpu(TimeStamp *ts) {
+    struct timespec spec;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &spec);
+
+    ts->sec = spec.tv_sec;
+    ts->usec = spec.tv_nsec / 1000;
+}
+
+/* Fast clock
+ * An invariant TSC ticks at a constant rate on every core, so once its rate
+ * is known against CLOCK_MONOTONIC a timestamp costs one rdtsc. Without one,
+ * or with CURSEMINER_NO_TSC set, the fast clock is CLOCK_MONOTONIC. The rate
+ * is only as exact as the calibration, so the two drift apart by a few ppm
+ * and fast clock timestamps should only be compared with each other.
+ */
+#define FAST_CLOCK_CALIBRATE_NS 10000000
+#define FAST_CLOCK_SHIFT 32
+
+static int g_fast_tsc = 0;
+static uint64_t g_fast_tsc_base, g_fast_ns_base;
+static uint64_t g_fast_mult; // Nanoseconds per tick << FAST_CLOCK_SHIFT
+
+static uint64_t monotonic_ns() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+
+    return (uint64_t) spec.tv_sec * 1000000000 + spec.tv_nsec;
+}
+
+#ifdef __x86_64__
+static int tsc_invariant() {
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(0x80000000, &a, &b, &c, &d) || a < 0x80000007) return 0;
+
+    __get_cpuid(0x80000007, &a, &b, &c, &d);
+
+    return (d >> 8) & 1;
+}
+#endif
+
+// Returns 1 if the fast clock runs on the TSC, must be called before threads
+int arch_fast_clock_init() {
+    g_fast_tsc = 0;
+
+#ifdef __x86_64__
+    if (!tsc_invariant() || getenv("CURSEMINER_NO_TSC")) return 0;
+
+    uint64_t ns0 = monotonic_ns(), tsc0 = __rdtsc();
+    uint64_t ns1, tsc1;
+
+    do {
+        ns1 = monotonic_ns();
+        tsc1 = __rdtsc();
+    } while (ns1 - ns0 < FAST_CLOCK_CALIBRATE_NS);
+
+    uint64_t ns = ns1 - ns0, ticks = tsc1 - tsc0;
+
+    // Anything outside 100MHz to 10GHz is a broken TSC or a confused VM
+    if (ticks < ns / 10 || ns * 10 < ticks) return 0;
+
+    g_fast_mult = (ns << FAST_CLOCK_SHIFT) / ticks;
+    g_fast_tsc_base = tsc1;
+    g_fast_ns_base = ns1;
+    g_fast_tsc = 1;
+#endif
+
+    return g_fast_tsc;
+}
+
+uint64_t arch_fast_clock_ns() {
+#ifdef __x86_64__
+    if (g_fast_tsc) {
+        // Signed, another core's TSC may read slightly behind the base
+        int64_t ticks = __rdtsc() - g_fast_tsc_base;
+        __int128 ns = ((__int128) ticks * g_fast_mult) >> FAST_CLOCK_SHIFT;
+
+        return g_fast_ns_base + (int64_t) ns;
+    }
+#endif
+
+    return monotonic_ns();
+}
+
+int arch_wakeup_fd_init() {
+    return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+// Async-signal-safe
+void arch_wakeup_fd_signal(int fd) {
+    uint64_t v = 1;
+
+    if (0 <= fd) write(fd, &v, sizeof(v));
+}
+
+void arch_wakeup_fd_clear(int fd) {
+    uint64_t v;
+
+    if (0 <= fd) read(fd, &v, sizeof(v));
+}
+
+int arch_poller_init() {
+    return epoll_create1(EPOLL_CLOEXEC);
+}
+
+void arch_poller_free(int poller) {
+    if (0 <= poller) close(poller);
+}
+
+int arch_poller_add(int poller, int fd, unsigned int events, void *data) {
+    struct epoll_event ev = {
+        .events = ((events & ARCH_POLL_IN)  ? EPOLLIN  : 0)
+                | ((events & ARCH_POLL_OUT) ? EPOLLOUT : 0),
+        .data.ptr = data,
+    };
+
+    return epoll_ctl(poller, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int arch_poller_del(int poller, int fd) {
+    return epoll_ctl(poller, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Waits until a registered fd is ready or until the absolute monotonic
+ * deadline, a NULL deadline only checks without blocking. Returns the number
+ * of events written to out.
+ */
+int arch_poller_wait(int poller, TimeStamp *deadline, ArchPollEvent *out, int max) {
+    struct epoll_event evs[max];
+    int timeout = 0;
+
+    if (deadline) {
+        TimeStamp now;
+        arch_get_time_monotonic(&now);
+
+        int64_t us = (int64_t) (deadline->sec - now.sec) * 1000000
+                   + (int64_t) deadline->usec - (int64_t) now.usec;
+
+        timeout = us <= 0 ? 0 : us / 1000;
+    }
+
+    int n = epoll_wait(poller, evs, max, timeout);
+
+    if (n < 0) n = 0;
+
+    for (int i = 0; i < n; i++) {
+        uint32_t e = evs[i].events;
+
+        out[i].data = evs[i].data.ptr;
+        out[i].events = ((e & EPOLLIN)  ? ARCH_POLL_IN  : 0)
+                      | ((e & EPOLLOUT) ? ARCH_POLL_OUT : 0)
+                      | ((e & EPOLLERR) ? ARCH_POLL_ERR : 0)
+                      | ((e & EPOLLHUP) ? ARCH_POLL_HUP : 0);
+    }
+
+    // epoll_wait() only has millisecond resolution, sleep off the rest
+    if (n == 0 && deadline) {
+        struct timespec abs = {
+            .tv_sec = deadline->sec,
+            .tv_nsec = (long) deadline->usec * 1000,
+        };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &abs, NULL) != 0);
+    }
+
+    return n;
+}
+
+int arch_cpu_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n < 1 ? 1 : n;
+}
+
+/* Only symbols in the dynamic symbol table are found, so static functions
+ * resolve to the closest exported symbol before them, or to nothing without
+ * -rdynamic.
+ */
+void arch_symbol_name(const void *addr, char *buf, int n) {
+    Dl_info info;
+
+    if (dladdr(addr, &info) && info.dli_sname) {
+        uintptr_t offset = (uintptr_t) addr - (uintptr_t) info.dli_saddr;
+
+        if (offset) snprintf(buf, n, "%s+0x%lx", info.dli_sname, (unsigned long) offset);
+        else snprintf(buf, n, "%s", info.dli_sname);
+
+    } else {
+        snprintf(buf, n, "%p", addr);
+    }
+}
+
+// Calls handler on SIGUSR1, it runs in signal context
+int arch_on_user_signal(void (*handler)(int)) {
+    struct sigaction sa = {0};
+
+    sa.sa_handler = handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    return sigaction(SIGUSR1, &sa, NULL);
+}
+
 
 #elifdef ESP_PLATFORM
 #include <freertos/FreeRTOS.h>
@@ -43,6 +295,22 @@ int arch_sleep(TimeStamp *ts) {
     return 0;
 }
 
+// No wakeup descriptors on this platform, fd is ignored
+int arch_sleep_until(TimeStamp *deadline, int fd) {
+    TimeStamp now;
+    arch_get_time_monotonic(&now);
+
+    int64_t us = (int64_t) (deadline->sec - now.sec) * 1000000
+               + (int64_t) deadline->usec - (int64_t) now.usec;
+
+    if (0 < us) {
+        TimeStamp ts = {.sec = us / 1000000, .usec = us % 1000000};
+        arch_sleep(&ts);
+    }
+
+    return 0;
+}
+
 void arch_get_time_monotonic(TimeStamp *ts) {
     int64_t us = esp_timer_get_time();
 
@@ -53,6 +321,62 @@ void arch_get_time_monotonic(TimeStamp *ts) {
     ts->usec = usec;
 }
 
+// FreeRTOS has no per-thread CPU clock, fall back to wall time
+void arch_get_time_thread_cpu(TimeStamp *ts) {
+    arch_get_time_monotonic(ts);
+}
+
+// esp_timer is already a cheap 64-bit microsecond counter
+int arch_fast_clock_init() {
+    return 0;
+}
+
+uint64_t arch_fast_clock_ns() {
+    return (uint64_t) esp_timer_get_time() * 1000;
+}
+
+int arch_wakeup_fd_init() {
+    return -1;
+}
+
+void arch_wakeup_fd_signal(int fd) {}
+
+void arch_wakeup_fd_clear(int fd) {}
+
+// No readiness notification on this platform, waiting only sleeps
+int arch_poller_init() {
+    return -1;
+}
+
+void arch_poller_free(int poller) {}
+
+int arch_poller_add(int poller, int fd, unsigned int events, void *data) {
+    return -1;
+}
+
+int arch_poller_del(int poller, int fd) {
+    return -1;
+}
+
+int arch_poller_wait(int poller, TimeStamp *deadline, ArchPollEvent *out, int max) {
+    if (deadline) arch_sleep_until(deadline, -1);
+
+    return 0;
+}
+
+void arch_symbol_name(const void *addr, char *buf, int n) {
+    snprintf(buf, n, "%p", addr);
+}
+
+// The second core is left to FreeRTOS, the game runs on one
+int arch_cpu_count() {
+    return 1;
+}
+
+int arch_on_user_signal(void (*handler)(int)) {
+    return -1;
+}
+
 
 #else
 #error "Unsupported platform"
@@ -59,11 +59,11 @@ void flush_game_entity_cache(GameContext *game) {
 
     memset(game->cache_entity, 0, cache_size * sizeof(Entity*));
 
-    Heap *h = &game->world->entities->heap;
+    IPQueue64 *pq = game->world->entities;
 
     int i = 0;
-    while (i < h->count) {
-        Entity *e = (Entity*) h->mempool[i].data;
+    while (i < pq->count) {
+        Entity *e = ipq_entry(ipq_get(pq, i), Entity, tick_node);
 
         if (game_on_screen(game, e->x, e->y)) {
 
@@ -223,31 +223,42 @@ int job_game_init_next(Task *tk, Stack64 *st) {
     return 0;
 }
 
-int game_update(Task* task, Stack64* stack) {
-    if (!GLOBALS.game)
-        GLOBALS.game = (GameContext*) qu_next(GLOBALS.games_qu);
+static void frame_entity_tick(void *ctx) {
+    GameContext *game = ctx;
+    IPQueue64* entity_pq = game->world->entities;
 
-    GameContext *game = GLOBALS.game;
-    PQueue64* entity_pq = game->world->entities;
-    milliseconds_t next_tick = _pq_peek(entity_pq, 0);
+    while (ipq_peek_weight(entity_pq) <= TIMER_NOW_MS) {
+        IHeapNode *node = ipq_peek(entity_pq);
+        Entity *e = ipq_entry(node, Entity, tick_node);
 
-    if (!pq_empty(entity_pq) && next_tick <= TIMER_NOW_MS) {
+        entity_tick_abstract(game, e);
+        e->next_tick = TIMER_NOW_MS + e->speed * 10;
 
-        while (_pq_peek(entity_pq, 0) <= TIMER_NOW_MS) {
-            Entity *e = (Entity*) pq_dequeue(entity_pq);
+        // Re-weight in place instead of popping and pushing
+        ipq_update(entity_pq, node, e->next_tick);
+    }
+}
 
-            entity_tick_abstract(game, e);
-            e->next_tick = TIMER_NOW_MS + e->speed * 10;
+static void frame_update(void *ctx) {
+    GameContext *game = ctx;
 
-            pq_enqueue(entity_pq, e, e->next_tick);
+    game->f_update();
+}
 
-            next_tick = _pq_peek(entity_pq, 0);
-        }
-    }
+int game_update(Task* task, Stack64* stack) {
+    // The frame graph also renders and presents for the frontend
+    tk_set_priority(task, TK_PRIO_HIGH);
 
-    game->f_update();
+    if (!GLOBALS.game)
+        GLOBALS.game = (GameContext*) qu_next(GLOBALS.games_qu);
+
+    tk_set_period(task, 1000 / GLOBALS.game->frame_rate,
+            GLOBALS.game->frame_slack_ms);
 
-    tk_sleep(task, 1000 / GAME_REFRESH_RATE);
+    if (fg_run(GLOBALS.game->frame) < 0) {
+        log_debug("ERROR: game frame graph has a dependency cycle");
+        tk_kill(task);
+    }
 
     return 0;
 }
@@ -270,6 +281,36 @@ GameContext *game_init(GameContextCFG *cfg, World *world) {
     game->world = world;
     game->behaviours = NULL;
 
+    game->frame = fg_init();
+    assert_log (game->frame != NULL,
+            "ERROR: failed to allocate game frame graph...");
+
+    game->frame_tick = fg_add(game->frame, "entity_tick", frame_entity_tick,
+            game, 0);
+    game->frame_update = fg_add(game->frame, "game_update", frame_update,
+            game, 0);
+    fg_depend(game->frame, game->frame_update, game->frame_tick);
+
+    game->frame_rate = GAME_REFRESH_RATE;
+    game->frame_slack_ms = GAME_REFRESH_SLACK_MS;
+
+    milliseconds_t slack = 0;
+    int rate = frontend_frame_init(game->frame, game->frame_tick,
+            game->frame_update, &slack);
+
+    assert_log (0 <= rate,
+            "ERROR: frontend failed to add its frame jobs...");
+
+    // Faster frontends drive the graph, the game's own jobs keep their rate
+    if (GAME_REFRESH_RATE < rate) {
+        unsigned int every = (rate + GAME_REFRESH_RATE / 2) / GAME_REFRESH_RATE;
+
+        game->frame_rate = rate;
+        game->frame_slack_ms = slack;
+        fg_every(game->frame, game->frame_tick, every);
+        fg_every(game->frame, game->frame_update, every);
+    }
+
     entity_init_default_controller();
 
     game_resize_viewport(game, GLOBALS.view_port_maxx, GLOBALS.view_port_maxy);
@@ -281,7 +322,8 @@ GameContext *game_init(GameContextCFG *cfg, World *world) {
 // TODO: free behaviours
 void game_exit(GameContext *game) {
     game->f_exit();
-    pq_clear(game->world->entities);
+    ipq_clear(game->world->entities);
+    fg_free(game->frame);
     free(game->behaviours);
     free(game->cache_entity);
     free(game->cache_world);
@@ -235,7 +235,8 @@ Entity* entity_spawn(GameContext *game, World* world, EntityType* type,
 
     new_entity->controller = &DEFAULT_CONTROLLER;
 
-    pq_enqueue(world->entities, new_entity, TIMER_NOW_MS);
+    ipq_node_init(&new_entity->tick_node);
+    ipq_enqueue(world->entities, &new_entity->tick_node, TIMER_NOW_MS);
 
     Entity **cache = game->cache_entity;
     gamew_cache_set(game, cache, x, y, new_entity);
@@ -245,6 +246,7 @@ Entity* entity_spawn(GameContext *game, World* world, EntityType* type,
 
 void entity_rm(World* world, Entity* entity) {
     if (world->entity_c <= 0) return;
+    ipq_remove(world->entities, &entity->tick_node);
     entity->id = -1;
     entity->type = NULL;
     if (entity->inventory) free(entity->inventory);
@@ -0,0 +1,219 @@
+#include <stdlib.h>
+
+#include "curseminer/globals.h"
+#include "curseminer/arch.h"
+#include "curseminer/parallel.h"
+#include "curseminer/framegraph.h"
+
+
+static uint64_t now_us() {
+    return arch_fast_clock_ns() / 1000;
+}
+
+static void fg_run_node(FrameNode *node) {
+    uint64_t start = now_us();
+
+    node->func(node->ctx);
+
+    node->last_us = now_us() - start;
+    if (node->max_us < node->last_us) node->max_us = node->last_us;
+}
+
+// Nodes of one level which run this frame, the parallel ones first
+typedef struct FrameBatch {
+    FrameGraph *fg;
+    int parallel, count;
+    unsigned char ids[FG_NODES_MAX];
+} FrameBatch;
+
+static void fg_run_batch(int64_t begin, int64_t end, void *arg) {
+    FrameBatch *batch = arg;
+
+    for (int64_t i = begin; i < end; i++)
+        fg_run_node(batch->fg->nodes + batch->ids[i]);
+}
+
+static void fg_run_serial(void *arg) {
+    FrameBatch *batch = arg;
+
+    fg_run_batch(batch->parallel, batch->count, batch);
+}
+
+
+FrameGraph *fg_init() {
+    return calloc(1, sizeof(FrameGraph));
+}
+
+void fg_free(FrameGraph *fg) {
+    free(fg);
+}
+
+// Returns the node's id, or -1 if the graph is full
+int fg_add(FrameGraph *fg, const char *name, void (*func)(void*), void *ctx,
+        int flags) {
+
+    if (FG_NODES_MAX <= fg->count) return -1;
+
+    FrameNode *node = fg->nodes + fg->count;
+    node->name = name;
+    node->func = func;
+    node->ctx = ctx;
+    node->after = 0;
+    node->flags = flags;
+    node->every = 1;
+    node->level = 0;
+    node->last_us = 0;
+    node->max_us = 0;
+
+    fg->compiled = 0;
+
+    return fg->count++;
+}
+
+// node only starts once after has finished
+int fg_depend(FrameGraph *fg, int node, int after) {
+    if (node < 0 || fg->count <= node || after < 0 || fg->count <= after)
+        return -1;
+
+    fg->nodes[node].after |= (uint32_t) 1 << after;
+    fg->compiled = 0;
+
+    return 0;
+}
+
+// node only runs on every nth frame, counting from the first
+int fg_every(FrameGraph *fg, int node, unsigned int n) {
+    if (node < 0 || fg->count <= node || n == 0) return -1;
+
+    fg->nodes[node].every = n;
+
+    return 0;
+}
+
+/* Splits the nodes into levels, each level only depending on earlier ones.
+ * Returns the number of levels, or -1 if the dependencies form a cycle.
+ */
+int fg_compile(FrameGraph *fg) {
+    uint32_t placed = 0;
+    int n = 0;
+
+    fg->levels = 0;
+
+    while (n < fg->count) {
+        uint32_t ready = 0;
+
+        for (int i = 0; i < fg->count; i++) {
+            uint32_t bit = (uint32_t) 1 << i;
+
+            if (!(placed & bit) && (fg->nodes[i].after & ~placed) == 0)
+                ready |= bit;
+        }
+
+        if (ready == 0) return -1;
+
+        fg->start[fg->levels] = n;
+
+        for (int i = 0; i < fg->count; i++) {
+            if (!(ready & ((uint32_t) 1 << i))) continue;
+
+            fg->nodes[i].level = fg->levels;
+            fg->order[n++] = i;
+        }
+
+        placed |= ready;
+        fg->levels++;
+    }
+
+    fg->start[fg->levels] = n;
+    fg->compiled = 1;
+
+    return fg->levels;
+}
+
+/* Runs every node due this frame once, see fg_every(). Returns how many ran
+ * or -1 if the graph has a cycle.
+ */
+int fg_run(FrameGraph *fg) {
+    if (!fg->compiled && fg_compile(fg) < 0) return -1;
+
+    uint64_t start = now_us();
+    int ran = 0;
+
+    for (int l = 0; l < fg->levels; l++) {
+        FrameBatch batch = {.fg = fg};
+        unsigned char serial[FG_NODES_MAX];
+        int serial_c = 0;
+
+        for (int i = fg->start[l]; i < fg->start[l + 1]; i++) {
+            FrameNode *node = fg->nodes + fg->order[i];
+
+            if (fg->frames % node->every) {
+                node->last_us = 0;
+                continue;
+            }
+
+            if (node->flags & FG_NODE_PARALLEL)
+                batch.ids[batch.parallel++] = fg->order[i];
+            else serial[serial_c++] = fg->order[i];
+        }
+
+        for (int i = 0; i < serial_c; i++)
+            batch.ids[batch.parallel + i] = serial[i];
+
+        batch.count = batch.parallel + serial_c;
+        ran += batch.count;
+
+        // Serial nodes run on the caller while the pool has the parallel ones
+        if (batch.parallel)
+            parallel_for_with(0, batch.parallel, 1, fg_run_batch, &batch,
+                    serial_c ? fg_run_serial : NULL, &batch);
+
+        else fg_run_serial(&batch);
+    }
+
+    fg->last_us = now_us() - start;
+    fg->frames++;
+
+    return ran;
+}
+
+// Longest chain of dependent nodes by their runtimes in the last frame
+uint64_t fg_critical_path_us(FrameGraph *fg) {
+    uint64_t finish[FG_NODES_MAX];
+    uint64_t longest = 0;
+
+    if (!fg->compiled && fg_compile(fg) < 0) return 0;
+
+    for (int i = 0; i < fg->count; i++) {
+        FrameNode *node = fg->nodes + fg->order[i];
+        uint64_t ready = 0;
+
+        for (int j = 0; j < i; j++) {
+            int dep = fg->order[j];
+
+            if ((node->after & ((uint32_t) 1 << dep)) && ready < finish[dep])
+                ready = finish[dep];
+        }
+
+        finish[fg->order[i]] = ready + node->last_us;
+        if (longest < ready + node->last_us) longest = ready + node->last_us;
+    }
+
+    return longest;
+}
+
+static int job_frame_graph(Task *task, Stack64 *st) {
+    if (fg_run((FrameGraph*) st) < 0) {
+        log_debug("Warning: frame graph %p has a cycle", (void*) st);
+        tk_kill(task);
+    }
+
+    return 0;
+}
+
+// Runs the graph every period ms from a task on rq, see schedule_periodic()
+int fg_schedule(FrameGraph *fg, RunQueue *rq, milliseconds_t period,
+        milliseconds_t slack) {
+
+    return schedule_periodic(rq, period, slack, job_frame_graph, (Stack64*) fg);
+}
@@ -57,6 +57,29 @@ void frontend_dispatch_event(event_ctx_t ctx, InputEvent *ie) {
     g_mapper_ctx_array[ctx][ie->id](ie);
 }
 
+static void dispatch_posted_event(uint64_t head, uint64_t data) {
+    InputEvent ie = {
+        .id     = (head >> 32) & 0xffff,
+        .type   = (head >> 24) & 0xff,
+        .state  = (head >> 16) & 0xff,
+        .mods   = (head >> 8)  & 0xff,
+        .data   = data,
+    };
+
+    frontend_dispatch_event(head & 0xff, &ie);
+}
+
+/* Dispatches the event on the main RunQueue's worker instead of the calling
+ * context. Safe from signal handlers, ISRs and other threads.
+ */
+int frontend_post_event(event_ctx_t ctx, InputEvent *ie) {
+    uint64_t head = ((uint64_t) ie->id << 32) | ((uint64_t) ie->type << 24)
+                  | ((uint64_t) ie->state << 16) | ((uint64_t) ie->mods << 8)
+                  | (uint64_t) ctx;
+
+    return rq_inject_call(GLOBALS.runqueue, dispatch_posted_event, head, ie->data);
+}
+
 static void intr_game_next(InputEvent *ie) {
     if (ie->state == ES_DOWN) return;
 
@@ -78,6 +101,22 @@ int frontend_init(const char *title) {
     return true;
 }
 
+/* Adds the frontend's jobs to a game's frame graph. Returns the rate the
+ * graph has to run at for them and sets slack, 0 if the frontend has no jobs
+ * or -1 on errors.
+ */
+int frontend_frame_init(FrameGraph *fg, int tick, int update,
+        milliseconds_t *slack) {
+
+    if (!g_frontend.f_frame_init) return 0;
+
+    if (g_frontend.f_frame_init(fg, tick, update) < 0) return -1;
+
+    *slack = g_frontend.refresh_slack_ms;
+
+    return g_frontend.refresh_rate;
+}
+
 void frontend_exit() {
     g_frontend.f_ui_exit(&g_frontend);
     g_frontend.f_input_exit(&g_frontend);
@@ -505,10 +505,24 @@ static void draw_tile(int x, int y, Skin *skin) {
     game_set_dirty(GLOBALS.game, x, y, 0);
 }
 
-static int job_render(Task *task, Stack64 *st) {
-    int tiles_drawn = widget_draw_game(GLOBALS.game, draw_tile);
+static int g_tiles_drawn = 0;
 
-    if (tiles_drawn) lcd_flush();
+static void frame_render(void *ctx) {
+    g_tiles_drawn = widget_draw_game(GLOBALS.game, draw_tile);
+}
+
+static void frame_present(void *ctx) {
+    if (g_tiles_drawn) lcd_flush();
+}
+
+static int frame_init(FrameGraph *fg, int tick, int update) {
+    int render = fg_add(fg, "esp32_render", frame_render, NULL, 0);
+    int present = fg_add(fg, "esp32_present", frame_present, NULL, 0);
+
+    if (render < 0 || present < 0) return -1;
+
+    fg_depend(fg, render, update);
+    fg_depend(fg, present, render);
 
     return 0;
 }
@@ -525,6 +539,8 @@ static int job_imu_input(Task *task, Stack64 *st) {
     static const int thld = 10000;
     int16_t x, y, z;
 
+    tk_set_priority(task, TK_PRIO_HIGH);
+
     read_accel_data(&x, &y, &z);
 
     if      (x > thld)  g_intent = I_DOWN;
@@ -690,10 +706,10 @@ void btn_isr_game_next(void *args) {
         .mods = E_NOMOD,
     };
 
-    frontend_dispatch_event(E_CTX_GAME, &ie);
+    frontend_post_event(E_CTX_GAME, &ie);
 
     ie.state = ES_UP;
-    frontend_dispatch_event(E_CTX_GAME, &ie);
+    frontend_post_event(E_CTX_GAME, &ie);
 }
 
 void btn_isr_break_tile(void *args) {
@@ -704,10 +720,10 @@ void btn_isr_break_tile(void *args) {
         .mods = E_NOMOD,
     };
 
-    frontend_dispatch_event(E_CTX_GAME, &ie);
+    frontend_post_event(E_CTX_GAME, &ie);
 
     ie.state = ES_UP;
-    frontend_dispatch_event(E_CTX_GAME, &ie);
+    frontend_post_event(E_CTX_GAME, &ie);
 }
 
 static esp_err_t init_btn(gpio_num_t gpio, void (*handler)(void*)) {
@@ -758,7 +774,8 @@ int frontend_esp32s3_ui_init(Frontend* fr, const char *title) {
     fr->width = g_resolution.w;
     fr->height = g_resolution.h;
 
-    schedule(GLOBALS.runqueue, 0, 0, job_render, NULL);
+    // Drawn once per game frame, nothing changes in between
+    fr->f_frame_init = frame_init;
 
     uint8_t *tmp = load_rgb("/spiffs/splash.raw", 128*128*3);
 
@@ -1,6 +1,28 @@
+#include <stdio.h>
+
+#include "curseminer/globals.h"
+#include "curseminer/scheduler.h"
 #include "curseminer/frontend.h"
 #include "curseminer/frontends/headless.h"
 
+#define DUMP_SLACK_MS 10 // Lets a dump share a tick with other timers
+
+static milliseconds_t g_dump_ms = 0;
+
+// Without a screen to show it on, print the task table every g_dump_ms
+static int job_dump_tasks(Task *task, Stack64 *st) {
+    tk_set_priority(task, TK_PRIO_LOW);
+    tk_set_period(task, g_dump_ms, DUMP_SLACK_MS);
+
+    fprintf(stderr, "=== TASKS @%" PRIu64 "ms ===\n", TIMER_NOW_MS - INIT_TIME_MS);
+    scheduler_dump_tasks(stderr);
+
+    fprintf(stderr, "=== FRAME JITTER ===\n");
+    time_jitter_dump(stderr);
+
+    return 0;
+}
+
 static bool set_glyphset(const char*) {
     return false;
 }
@@ -25,9 +47,20 @@ int frontend_headless_ui_init(Frontend *fr, const char* title) {
     fr->width = 0;
     fr->height = 0;
 
+    if (0 < g_dump_ms) {
+        scheduler_set_task_stats(1);
+        schedule_named(GLOBALS.runqueue, "headless_dump", g_dump_ms, 0,
+                job_dump_tasks, NULL, NULL);
+    }
+
     return 0;
 }
 
+// Prints task stats and frame jitter every period ms, 0 turns it off
+void frontend_headless_set_dump(milliseconds_t period) {
+    g_dump_ms = period;
+}
+
 void frontend_headless_ui_exit(Frontend*) {}
 
 int frontend_headless_input_init(Frontend*) {
@@ -1,8 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <signal.h>
 #include <time.h>
 #include <math.h>
 #include <string.h>
@@ -10,6 +8,7 @@
 #include <ncurses.h>
 
 #include "curseminer/globals.h"
+#include "curseminer/arch.h"
 #include "curseminer/util.h"
 #include "curseminer/stack64.h"
 #include "curseminer/time.h"
@@ -24,6 +23,7 @@
 #define NAME_MAX 64
 #define GLYPH_MAX 256
 #define REFRESH_RATE 120
+#define REFRESH_SLACK_MS 2
 
 // TODO: Read from file or define via function
 #define GLYPHSET_00_NAME    "tiles_00"
@@ -71,6 +71,7 @@ static Stack64* MENU_STACK;
 static bool g_glyph_init[GLYPH_MAX];
 static bool g_ansi_fallbacks_enabled;
 static bool g_ncurses_quit;
+static bool g_uiwin_top;
 static char *g_glyph_charset = GLYPHSET_00;
 static HashTable *g_glyph_charsets;
 
@@ -223,6 +224,15 @@ static void intr_redraw_everything(InputEvent *ie) {
     PRINT_CHARACTER++;
 }
 
+static void intr_toggle_task_top(InputEvent *ie) {
+    if (ie->state == ES_UP) {
+        g_uiwin_top = !g_uiwin_top;
+
+        // Accounting stays on once requested, the totals stay comparable
+        if (g_uiwin_top) scheduler_set_task_stats(1);
+    }
+}
+
 void UI_toggle_widgetwin();
 static void ui_input_widget_toggle(InputEvent *ie) {
     if (ie->state == ES_UP) {
@@ -427,8 +437,46 @@ static void draw_gamewin(window_t *gamewin) {
     widget_draw_game(GLOBALS.game, draw_tile);
 }
 
+// Top style list of the tasks with the most runtime, toggled with F7
+#define TOP_ROWS_MAX 64
+static void draw_task_top(window_t *uiwin) {
+    TaskInfo infos[TOP_ROWS_MAX];
+    int total = scheduler_task_info(infos, TOP_ROWS_MAX);
+    int n = total < TOP_ROWS_MAX ? total : TOP_ROWS_MAX;
+    int rows = uiwin->h - 1;
+
+    scheduler_sort_task_info(infos, n);
+
+    mvwprintw(uiwin->win, 0, 1, "%-20s %2s %2s %3s %9s %10s %7s %7s %7s %5s  (%d tasks)",
+            "TASK", "ST", "PR", "WRK", "CALLS", "TOTAL_US", "MAX_US",
+            "LATE_US", "MAXLATE", "MISS", total);
+
+    for (int i = 0; i < n && i < rows; i++) {
+        TaskInfo *info = infos + i;
+        TaskStats *st = &info->stats;
+        char name[21];
+
+        if (info->name) snprintf(name, sizeof(name), "%s", info->name);
+        else arch_symbol_name((void*) info->func, name, sizeof(name));
+
+        mvwprintw(uiwin->win, i + 1, 1,
+                "%-20s %2c %2u %3u %9lu %10lu %7u %7lu %7u %5u",
+                name, info->state, info->prio, info->worker,
+                (unsigned long) st->calls, (unsigned long) st->total_us,
+                st->max_us,
+                (unsigned long) (st->wakes ? st->late_total_us / st->wakes : 0),
+                st->max_late_us, st->misses);
+    }
+}
+
 static void draw_uiwin(window_t *uiwin) {
     werase(uiwin->win);
+
+    if (g_uiwin_top) {
+        draw_task_top(uiwin);
+        return;
+    }
+
     draw_rt_clock(uiwin, uiwin->h/2+2, uiwin->h/2, uiwin->h/2);
 
     mvwprintw(uiwin->win, 5, 20, "Player: (%d, %d) [%c%d, %c%d]",
@@ -666,16 +714,29 @@ void UI_toggle_widgetwin() {
     else UI_show_window(g_widgetwin);
 }
 
-int job_loop(Task *task, Stack64 *st) {
-    if (st_peek(MENU_STACK) == -1 || g_ncurses_quit)
-        tk_kill(task);
+/* Frame Graph Jobs */
+static void frame_render(void *ctx) {
+    if (st_peek(MENU_STACK) == -1 || g_ncurses_quit) return;
 
     voidfunc draw_func = (voidfunc) st_peek(MENU_STACK);
 
     draw_func();
+}
+
+static void frame_present(void *ctx) {
+    if (st_peek(MENU_STACK) == -1 || g_ncurses_quit) return;
+
     doupdate();
+}
+
+static int frame_init(FrameGraph *fg, int tick, int update) {
+    int render = fg_add(fg, "ncurses_render", frame_render, NULL, 0);
+    int present = fg_add(fg, "ncurses_present", frame_present, NULL, 0);
 
-    tk_sleep(task, REFRESH_RATE / 1000);
+    if (render < 0 || present < 0) return -1;
+
+    fg_depend(fg, render, update);
+    fg_depend(fg, present, render);
 
     return 0;
 }
@@ -684,8 +745,8 @@ int job_loop(Task *task, Stack64 *st) {
 
 /* Input Handling*/
 
-#define msec_to_nsec(ms) ms * 1000000
 #define g_keyup_delay 250
+#define INPUT_POLL_MS 10
 
 typedef struct {
     event_t id;
@@ -702,8 +763,11 @@ KeyDownState *NEXT_AVAILABLE_KDS = KEY_DOWN_STATES_ARRAY;
 static event_t g_ncurses_mapping_kb[ NCURSES_KBMAP_MAX ];
 static InputEvent g_ncurses_mapping_ms[ NCURSES_MSMAP_MAX ];
 
-static timer_t g_input_timer = 0;
 static Queue64 *g_queued_kdown = NULL;
+static milliseconds_t g_last_kdown = 0;
+static bool g_keyup_pending = false;
+
+int job_keyup(Task*, Stack64*);
 
 static void init_keys_ncurses() {
     for (int i = 0; i < NCURSES_KBMAP_MAX; i++) 
@@ -779,13 +843,9 @@ static void map_event_ncurses(InputEvent *ev, int key) {
 
 }
 
-static void handle_kdown_ncurses(int signo) {
+static void handle_kdown_ncurses(int key) {
     InputEvent ev;
 
-    int key = getch();
-
-    if (key == -1) return;
-
     event_ctx_t ctx = GLOBALS.input_context;
     map_event_ncurses(&ev, key);
 
@@ -794,11 +854,13 @@ static void handle_kdown_ncurses(int signo) {
         ev.state = ES_DOWN;
 
         // Reset keyup timer
-        struct itimerspec its = {0};
-
-        its.it_value.tv_nsec = msec_to_nsec(g_keyup_delay);
+        g_last_kdown = TIMER_NOW_MS;
 
-        timer_settime(g_input_timer, 0, &its, NULL);
+        if (!g_keyup_pending) {
+            g_keyup_pending = true;
+            schedule_named(GLOBALS.runqueue, "ncurses_keyup", g_keyup_delay, 0,
+                    job_keyup, NULL, NULL);
+        }
 
         /* Process all pending ES_UP events and ensure there is space for
            this event. */
@@ -848,7 +910,7 @@ static void handle_kdown_ncurses(int signo) {
     frontend_dispatch_event(ctx, &ev);
 }
 
-static void handle_kup_ncurses(int signo) {
+static void handle_kup_ncurses() {
     event_ctx_t ctx = GLOBALS.input_context;
 
     while (!qu_empty(g_queued_kdown)) {
@@ -867,6 +929,46 @@ static void handle_kup_ncurses(int signo) {
     }
 }
 
+// Simulates ES_UP events once no key was pressed for g_keyup_delay
+int job_keyup(Task *task, Stack64 *st) {
+    tk_set_priority(task, TK_PRIO_HIGH);
+
+    milliseconds_t due = g_last_kdown + g_keyup_delay;
+
+    if (TIMER_NOW_MS < due) {
+        tk_sleep(task, due - TIMER_NOW_MS);
+        return 0;
+    }
+
+    handle_kup_ncurses();
+
+    g_keyup_pending = false;
+    tk_kill(task);
+
+    return 0;
+}
+
+/* Parked on stdin by the scheduler's reactor, falls back to polling if stdin
+ * can't be watched */
+int job_input(Task *task, Stack64 *st) {
+    tk_set_priority(task, TK_PRIO_HIGH);
+
+    if (g_ncurses_quit) {
+        tk_kill(task);
+        return 0;
+    }
+
+    int key;
+    while ((key = getch()) != ERR)
+        handle_kdown_ncurses(key);
+
+    if (task->revents & (ARCH_POLL_ERR | ARCH_POLL_HUP)
+            || tk_wait_fd(task, STDIN_FILENO, ARCH_POLL_IN) < 0)
+        tk_sleep(task, INPUT_POLL_MS);
+
+    return 0;
+}
+
 static int charset_normalize_name(char *dst, const char *src, char target) {
     int len = strlen(src);
     len = NAME_MAX < len ? NAME_MAX : len;
@@ -993,6 +1095,7 @@ int frontend_ncurses_ui_init(Frontend* fr, const char *title) {
 
     frontend_register_event(E_KB_F4, E_CTX_GAME, intr_dump_game_world);
     frontend_register_event(E_KB_F5, E_CTX_GAME, intr_redraw_everything);
+    frontend_register_event(E_KB_F7, E_CTX_GAME, intr_toggle_task_top);
 
     GLOBALS.view_port_x = gwx;
     GLOBALS.view_port_y = gwy;
@@ -1010,7 +1113,10 @@ int frontend_ncurses_ui_init(Frontend* fr, const char *title) {
     box_win(uiwin);
     box_win(invwin);
 
-    schedule(GLOBALS.runqueue, 0, 0, job_loop, NULL);
+    // Drawn from each game's frame graph, input comes in through job_input
+    fr->f_frame_init = frame_init;
+    fr->refresh_rate = REFRESH_RATE;
+    fr->refresh_slack_ms = REFRESH_SLACK_MS;
 
     LATTICE1D = noise_init(100, 1, 100, smoothstep);
 
@@ -1027,29 +1133,9 @@ int frontend_ncurses_input_init(Frontend* fr) {
     init_keys_ncurses();
     g_queued_kdown = qu_init(1);
 
-    struct sigevent se = {
-        .sigev_notify = SIGEV_SIGNAL,
-        .sigev_signo = SIGALRM,
-    };
-
-    struct sigaction sa;
-    sa.sa_flags = 0;
-    sigemptyset(&sa.sa_mask);
-
-    /* 2. Create timer to simulate ES_KEYUP events using SIGALRM interrupt */
-    timer_create(CLOCK_MONOTONIC, &se, &g_input_timer);
-
-    sa.sa_handler = handle_kup_ncurses;
-    sigaction(SIGALRM, &sa, NULL);
-
-    /* 3. Register SIGIO interrupt to trigger when input is available on stdin
-     *    and process it in handle_kdown_ncurses */
-    sa.sa_handler = handle_kdown_ncurses;
-    sigaction(SIGIO, &sa, NULL);
-
-    int flags = fcntl(STDIN_FILENO, F_GETFL);
-    fcntl(STDIN_FILENO, F_SETFL, flags | O_ASYNC);
-    fcntl(STDIN_FILENO, F_SETOWN, getpid());
+    /* 2. Read stdin from a task which sleeps until input is available, ES_UP
+     *    events are simulated by job_keyup */
+    schedule_named(GLOBALS.runqueue, "ncurses_input", 0, 0, job_input, NULL, NULL);
 
     set_glyphset(GLYPHSET_00_NAME);
 
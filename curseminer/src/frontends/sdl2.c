@@ -15,6 +15,7 @@
 
 #define SPRITE_MAX 256
 #define REFRESH_RATE 20
+#define REFRESH_SLACK_MS 5
 
 typedef const Uint32 bitmask_sdl;
 
@@ -320,13 +321,6 @@ static void draw_tile(int x, int y, Skin *skin) {
     f_draw_tile(skin, &r);
 }
 
-void draw_game() {
-    SDL_SetRenderTarget(g_renderer, g_canvas);
-
-    int tiles_drawn = widget_draw_game(GLOBALS.game, draw_tile);
-
-    if (tiles_drawn) flush_screen();
-}
 
 
 
@@ -462,44 +456,50 @@ static void fill_rect(Skin *skin, int x1, int y1, int x2, int y2) {
 
 
 
-/* Scheduler Jobs */
-static int job_animate(Task *task, Stack64 *st) {
-    if (!g_spritesheet || g_spritesheet->layers <= 1) return 0;
-
-    g_sprite_frame = (g_sprite_frame + 1) % (g_spritesheet->layers);
+/* Frame Graph Jobs */
+static milliseconds_t g_next_animate = 0;
+static int g_tiles_drawn = 0;
 
-    game_flush_dirty(GLOBALS.game);
-    tk_sleep(task, g_spritesheet->delay);
+static void frame_poll(void *ctx) {
+    SDL_Event ev;
 
-    return 0;
+    while (SDL_PollEvent(&ev))
+        if (ev.type == SDL_QUIT) scheduler_kill_all_tasks();
 }
 
-int job_poll(Task *task, Stack64 *st) {
-    SDL_Event ev;
+static void frame_animate(void *ctx) {
+    if (!g_spritesheet || g_spritesheet->layers <= 1) return;
+    if (TIMER_NOW_MS < g_next_animate) return;
 
-    while (SDL_PollEvent(&ev)) {}
+    g_next_animate = TIMER_NOW_MS + g_spritesheet->delay;
+    g_sprite_frame = (g_sprite_frame + 1) % (g_spritesheet->layers);
 
-    if (ev.type == SDL_QUIT)
-        scheduler_kill_all_tasks();
+    game_flush_dirty(GLOBALS.game);
+}
 
-    return 0;
+static void frame_render(void *ctx) {
+    SDL_SetRenderTarget(g_renderer, g_canvas);
+
+    g_tiles_drawn = widget_draw_game(GLOBALS.game, draw_tile);
 }
 
-static int job_loop(Task *task, Stack64 *st) {
-    draw_game();
-    tk_sleep(task, 1000 / REFRESH_RATE);
-    return 0;
+static void frame_present(void *ctx) {
+    if (g_tiles_drawn) flush_screen();
 }
 
-static int job_wait_for_game(Task *task, Stack64 *st) {
-    if (!GLOBALS.game) tk_sleep(task, 1000);
+// input -> tick -> update -> animate -> render -> present
+static int frame_init(FrameGraph *fg, int tick, int update) {
+    int poll = fg_add(fg, "sdl2_poll", frame_poll, NULL, 0);
+    int animate = fg_add(fg, "sdl2_animate", frame_animate, NULL, 0);
+    int render = fg_add(fg, "sdl2_render", frame_render, NULL, 0);
+    int present = fg_add(fg, "sdl2_present", frame_present, NULL, 0);
 
-    else {
-        schedule(GLOBALS.runqueue, 0, 0, job_loop, NULL);
-        schedule(GLOBALS.runqueue, 0, 0, job_poll, NULL);
-        schedule(GLOBALS.runqueue, 0, 0, job_animate, NULL);
-        tk_kill(task);
-    }
+    if (poll < 0 || animate < 0 || render < 0 || present < 0) return -1;
+
+    fg_depend(fg, tick, poll);
+    fg_depend(fg, animate, update);
+    fg_depend(fg, render, animate);
+    fg_depend(fg, present, render);
 
     return 0;
 }
@@ -533,20 +533,21 @@ int frontend_sdl2_ui_init(Frontend *fr, const char *title) {
 
     assert_SDL(g_canvas != NULL, "Failed to create SDL main canvas texture");
 
-    // 4. Init draw func, tasks and interrupts
+    // 4. Init draw func
     f_draw_tile = draw_tile_rect;
 
     recalculate_tile_size(g_tile_w);
 
-    schedule(GLOBALS.runqueue, 0, 0, job_wait_for_game, NULL);
-
-    // 5. Init frontend
+    // 5. Init frontend, drawing happens in each game's frame graph
     fr->f_set_glyphset = set_glyphset;
     fr->f_draw_point = draw_point;
     fr->f_draw_line = draw_line;
     fr->f_fill_rect = fill_rect;
     fr->width = display_mode.w;
     fr->height = display_mode.h;
+    fr->f_frame_init = frame_init;
+    fr->refresh_rate = REFRESH_RATE;
+    fr->refresh_slack_ms = REFRESH_SLACK_MS;
 
     frontend_register_event(E_KB_F5, E_CTX_GAME, intr_redraw_everything);
     frontend_register_event(E_KB_J, E_CTX_GAME, intr_zoom_in);
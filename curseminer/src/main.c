@@ -2,11 +2,15 @@
 #define COMPILE_FRONTEND_SDL2
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "curseminer/globals.h"
 #include "curseminer/scheduler.h"
 #include "curseminer/time.h"
+#include "curseminer/arch.h"
+#include "curseminer/trace.h"
+#include "curseminer/watchdog.h"
 #include "curseminer/games/curseminer.h"
 #include "curseminer/games/other.h"
 #include "curseminer/frontends/headless.h"
@@ -23,6 +27,7 @@
 #define UPDATE_RATE 120 // times per second
 #define SCREEN_REFRESH_RATE 20 // times per second
 #define KEYBOARD_EMPTY_RATE 1000000 / 2
+#define WATCHDOG_STUCK_MS 250
 
 typedef enum {
     FRONTEND_HEADLESS,
@@ -41,9 +46,20 @@ struct Globals GLOBALS = {
 };
 
 static RunQueue* g_runqueue = NULL;
+static int g_virtual_time = 0;
+static milliseconds_t g_duration_ms = 0;
+static int g_watchdog_ms = 0;
+static const char *g_trace_path = NULL;
+static int g_spin_us = 0;
+static int g_stats_s = 0;
+
+static void on_user_signal(int signo) {
+    trace_request_flush();
+}
 
 static void init(frontend_t frontend, const char *title) {
     time_init(UPDATE_RATE);
+    time_set_spin_us(g_spin_us);
 
     GLOBALS.runqueue_list = scheduler_init();
     g_runqueue = scheduler_new_rq_(GLOBALS.runqueue_list);
@@ -52,6 +68,26 @@ static void init(frontend_t frontend, const char *title) {
     assert_log(GLOBALS.runqueue_list && g_runqueue,
             "failed to initialize main RunQueue");
 
+    // Game and frontend code is not thread safe, keep it on the main thread
+    rq_pin(g_runqueue, GLOBALS.runqueue_list);
+    scheduler_set_tickless(1);
+    scheduler_set_virtual(g_virtual_time);
+
+    if (0 < g_watchdog_ms) {
+        watchdog_set_threshold(g_watchdog_ms * 1000);
+        watchdog_monitor(WATCHDOG_STUCK_MS);
+    }
+
+    if (g_trace_path) {
+        if (trace_start(g_trace_path) == 0)
+            arch_on_user_signal(on_user_signal);
+        else
+            fprintf(stderr, "trace path is too long: %s\n", g_trace_path);
+    }
+
+    if (0 < g_stats_s)
+        frontend_headless_set_dump((milliseconds_t) g_stats_s * 1000);
+
     frontend_init_ui_t fuii = frontend_headless_ui_init;
     frontend_exit_ui_t fuie = frontend_headless_ui_exit;
     frontend_init_input_t fini = frontend_headless_input_init;
@@ -94,6 +130,9 @@ static int exit_state() {
     frontend_exit();
 
     game_exit(GLOBALS.game);
+
+    if (0 < g_watchdog_ms) watchdog_dump(stderr);
+
     scheduler_free();
 
     return 0;
@@ -107,12 +146,25 @@ static void main_event_handler(InputEvent *ev) {
     scheduler_kill_all_tasks();
 }
 
+static int job_quit(Task* task, Stack64* stack) {
+    scheduler_kill_all_tasks();
+    tk_kill(task);
+
+    return 0;
+}
+
 int main(int argc, const char** argv) {
     if (argc < MIN_ARGS+1) return -1;
 
     const char *nogui_string = "-nogui";
     const char *tui_string = "-tui";
     const char *gui_string = "-gui";
+    const char *virtual_string = "-virtual";
+    const char *duration_string = "-duration";
+    const char *watchdog_string = "-watchdog";
+    const char *trace_string = "-trace";
+    const char *spin_string = "-spin";
+    const char *stats_string = "-stats";
     const char *title = "Curseminer!";
     int frontend;
 
@@ -134,6 +186,30 @@ int main(int argc, const char** argv) {
 
             } else if (0 == strncmp(argv[i], gui_string, 7)) {
                 frontend = FRONTEND_SDL2;
+
+            // Run on simulated time, as fast as the CPU allows
+            } else if (0 == strncmp(argv[i], virtual_string, 9)) {
+                g_virtual_time = 1;
+
+            // Quit after this many (possibly simulated) seconds
+            } else if (0 == strncmp(argv[i], duration_string, 10) && i+1 < argc) {
+                g_duration_ms = (milliseconds_t) strtoull(argv[++i], NULL, 10) * 1000;
+
+            // Report task runs slower than this many milliseconds
+            } else if (0 == strncmp(argv[i], watchdog_string, 10) && i+1 < argc) {
+                g_watchdog_ms = atoi(argv[++i]);
+
+            // Record a Chrome trace, written on exit and on SIGUSR1
+            } else if (0 == strncmp(argv[i], trace_string, 7) && i+1 < argc) {
+                g_trace_path = argv[++i];
+
+            // Busy wait the last microseconds of each frame for less jitter
+            } else if (0 == strncmp(argv[i], spin_string, 6) && i+1 < argc) {
+                g_spin_us = atoi(argv[++i]);
+
+            // Headless only, print task stats and jitter every N seconds
+            } else if (0 == strncmp(argv[i], stats_string, 7) && i+1 < argc) {
+                g_stats_s = atoi(argv[++i]);
             }
         }
     }
@@ -166,7 +242,10 @@ int main(int argc, const char** argv) {
     GLOBALS.world = world_init(20, 1000, 64 * PAGE_SIZE);
     GLOBALS.game = game_init(gcfgs, GLOBALS.world);
 
-    schedule_cb(g_runqueue, 0, 0, game_update, NULL, cb_exit);
+    schedule_named(g_runqueue, "game_update", 0, 0, game_update, NULL, cb_exit);
+
+    if (0 < g_duration_ms)
+        schedule_named(g_runqueue, "main_quit", g_duration_ms, 0, job_quit, NULL, NULL);
 
     frontend_register_event(E_KB_Q, E_CTX_GAME, main_event_handler);
     frontend_register_event(E_KB_Q, E_CTX_NOISE, main_event_handler);
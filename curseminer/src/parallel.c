@@ -0,0 +1,251 @@
+#include <pthread.h>
+
+#include "curseminer/globals.h"
+#include "curseminer/arch.h"
+#include "curseminer/parallel.h"
+
+/* The pool works on one job at a time. Threads take chunks off it through an
+ * atomic counter, results of parallel_reduce() are kept per chunk so they are
+ * joined in the same order no matter which thread ran them.
+ */
+typedef struct ParallelJob {
+    parallel_for_t f_for;
+    parallel_map_t f_map;
+    void *ctx;
+    TimeStamp now; // Frame clock of the caller, adopted by pool threads
+    int64_t begin, end, grain;
+    unsigned int chunks, next, done;
+    uint64_t partials[PARALLEL_CHUNKS_MAX];
+} ParallelJob;
+
+static pthread_t g_threads[PARALLEL_THREADS_MAX];
+static int g_threads_c = -1; // -1 until parallel_init()
+static int g_stopping = 0;
+
+// Held by the thread which owns the pool, others run their loops inline
+static pthread_mutex_t g_owner_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Guards the job and the counters below
+static pthread_mutex_t g_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_idle_cond = PTHREAD_COND_INITIALIZER;
+static ParallelJob g_job;
+static unsigned int g_job_gen = 0, g_busy = 0;
+
+static _Thread_local int t_in_chunk = 0;
+
+
+static void job_run_chunk(ParallelJob *job, unsigned int i) {
+    int64_t begin = job->begin + (int64_t) i * job->grain;
+    int64_t end = begin + job->grain < job->end ? begin + job->grain : job->end;
+
+    t_in_chunk = 1;
+
+    if (job->f_map) job->partials[i] = job->f_map(begin, end, job->ctx);
+    else job->f_for(begin, end, job->ctx);
+
+    t_in_chunk = 0;
+}
+
+static void job_work(ParallelJob *job) {
+    unsigned int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_ACQ_REL)) < job->chunks) {
+        job_run_chunk(job, i);
+        __atomic_add_fetch(&job->done, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+static void *pool_thread(void *arg) {
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&g_pool_mutex);
+
+    while (1) {
+        while (g_job_gen == seen && !g_stopping)
+            pthread_cond_wait(&g_job_cond, &g_pool_mutex);
+
+        if (g_stopping) break;
+
+        seen = g_job_gen;
+        g_busy++;
+        pthread_mutex_unlock(&g_pool_mutex);
+
+        time_set_now(&g_job.now);
+        job_work(&g_job);
+
+        pthread_mutex_lock(&g_pool_mutex);
+        if (--g_busy == 0) pthread_cond_broadcast(&g_idle_cond);
+    }
+
+    pthread_mutex_unlock(&g_pool_mutex);
+
+    return NULL;
+}
+
+/* Starts the pool with the given number of threads besides the caller, or
+ * one less than there are CPUs if threads is 0. Returns how many started.
+ */
+int parallel_init(int threads) {
+    if (0 <= g_threads_c) return g_threads_c;
+
+    if (threads <= 0) threads = arch_cpu_count() - 1;
+    if (PARALLEL_THREADS_MAX < threads) threads = PARALLEL_THREADS_MAX;
+
+    g_stopping = 0;
+    g_threads_c = 0;
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(g_threads + i, NULL, pool_thread, NULL) != 0) break;
+        g_threads_c++;
+    }
+
+    return g_threads_c;
+}
+
+void parallel_free() {
+    if (g_threads_c < 0) return;
+
+    pthread_mutex_lock(&g_pool_mutex);
+    g_stopping = 1;
+    pthread_cond_broadcast(&g_job_cond);
+    pthread_mutex_unlock(&g_pool_mutex);
+
+    for (int i = 0; i < g_threads_c; i++)
+        pthread_join(g_threads[i], NULL);
+
+    g_threads_c = -1;
+}
+
+int parallel_threads() {
+    return g_threads_c < 0 ? 0 : g_threads_c;
+}
+
+// Grain which keeps the chunk count within PARALLEL_CHUNKS_MAX
+static int64_t job_grain(int64_t begin, int64_t end, int64_t grain) {
+    int64_t n = end - begin;
+
+    if (grain < 1) grain = 1;
+    if (PARALLEL_CHUNKS_MAX < (n + grain - 1) / grain)
+        grain = (n + PARALLEL_CHUNKS_MAX - 1) / PARALLEL_CHUNKS_MAX;
+
+    return grain;
+}
+
+/* Runs the job on the pool and the calling thread, which first runs serial if
+ * given. Returns 0 if the pool could not be used and the caller has to run it
+ * inline, otherwise the pool stays owned by the caller until it calls
+ * pool_release().
+ */
+static int pool_run(int64_t begin, int64_t end, int64_t grain,
+        parallel_for_t f_for, parallel_map_t f_map, void *ctx,
+        void (*serial)(void*), void *serial_ctx) {
+
+    unsigned int chunks = (end - begin + grain - 1) / grain;
+
+    // A single chunk is still worth handing off if the caller has other work
+    if (chunks < (serial ? 1u : 2u) || t_in_chunk) return 0;
+    if (pthread_mutex_trylock(&g_owner_mutex) != 0) return 0;
+
+    if (g_threads_c < 0) parallel_init(0);
+
+    if (g_threads_c == 0) {
+        pthread_mutex_unlock(&g_owner_mutex);
+        return 0;
+    }
+
+    pthread_mutex_lock(&g_pool_mutex);
+
+    // Stragglers of the previous job may still be looking at it
+    while (g_busy) pthread_cond_wait(&g_idle_cond, &g_pool_mutex);
+
+    g_job.f_for = f_for;
+    g_job.f_map = f_map;
+    g_job.ctx = ctx;
+    g_job.now = TIMER_NOW;
+    g_job.begin = begin;
+    g_job.end = end;
+    g_job.grain = grain;
+    g_job.chunks = chunks;
+    g_job.next = 0;
+    g_job.done = 0;
+
+    g_job_gen++;
+    pthread_cond_broadcast(&g_job_cond);
+    pthread_mutex_unlock(&g_pool_mutex);
+
+    if (serial) serial(serial_ctx);
+    job_work(&g_job);
+
+    pthread_mutex_lock(&g_pool_mutex);
+
+    while (__atomic_load_n(&g_job.done, __ATOMIC_ACQUIRE) < chunks || g_busy)
+        pthread_cond_wait(&g_idle_cond, &g_pool_mutex);
+
+    pthread_mutex_unlock(&g_pool_mutex);
+
+    return 1;
+}
+
+static void pool_release() {
+    pthread_mutex_unlock(&g_owner_mutex);
+}
+
+/* Like parallel_for(), but the caller runs serial(serial_ctx) while the pool
+ * starts on the chunks and helps with whatever is left afterwards. Without
+ * the pool the chunks run inline first, then serial. Loops started from
+ * serial run inline, the caller still owns the pool.
+ */
+void parallel_for_with(int64_t begin, int64_t end, int64_t grain,
+        parallel_for_t func, void *ctx, void (*serial)(void*), void *serial_ctx) {
+
+    if (end <= begin) {
+        if (serial) serial(serial_ctx);
+        return;
+    }
+
+    grain = job_grain(begin, end, grain);
+
+    if (pool_run(begin, end, grain, func, NULL, ctx, serial, serial_ctx)) {
+        pool_release();
+        return;
+    }
+
+    func(begin, end, ctx);
+    if (serial) serial(serial_ctx);
+}
+
+void parallel_for(int64_t begin, int64_t end, int64_t grain,
+        parallel_for_t func, void *ctx) {
+
+    parallel_for_with(begin, end, grain, func, ctx, NULL, NULL);
+}
+
+/* Maps every chunk to a value and folds them left to right with join,
+ * starting from identity. Chunks are the same whether or not the pool is
+ * used, so the result does not depend on it.
+ */
+uint64_t parallel_reduce(int64_t begin, int64_t end, int64_t grain,
+        uint64_t identity, parallel_map_t map, parallel_join_t join, void *ctx) {
+
+    uint64_t acc = identity;
+
+    if (end <= begin) return acc;
+
+    grain = job_grain(begin, end, grain);
+
+    if (pool_run(begin, end, grain, NULL, map, ctx, NULL, NULL)) {
+        for (unsigned int i = 0; i < g_job.chunks; i++)
+            acc = join(acc, g_job.partials[i]);
+
+        pool_release();
+
+    } else {
+        for (int64_t i = begin; i < end; i += grain) {
+            int64_t e = i + grain < end ? i + grain : end;
+            acc = join(acc, map(i, e, ctx));
+        }
+    }
+
+    return acc;
+}
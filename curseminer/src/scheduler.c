@@ -1,397 +1,2144 @@
 #include <sys/time.h>
 #include <stdio.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
 
 #include "curseminer/globals.h"
 #include "curseminer/scheduler.h"
+#include "curseminer/arch.h"
+#include "curseminer/parallel.h"
+#include "curseminer/trace.h"
+#include "curseminer/watchdog.h"
+
+/* Locking
+ * Locks nest only in this order, a lock may be taken while holding the ones
+ * before it but never the other way around:
+ *
+ *   RunQueue.mutex -> g_wait_mutex -> g_sleep_mutex
+ *   RunQueue.mutex -> SchedWorker.wait_mutex
+ *   RunQueue.mutex -> g_deadline_mutex
+ *
+ * At most one RunQueue is locked at a time, and none while Task.func or a
+ * task callback runs.
+ */
+
+// Upper bound for a tickless wait when no task is sleeping
+#define TICKLESS_MAX_WAIT_MS 1000
+#define REACTOR_EVENTS_MAX 32
+#define DEADLINE_BATCH 64
+
+
+const unsigned char RQ_FLAG_BIT         = 0b00000001;
+const unsigned char RQ_FLAG_KILLED      = 0b00000010;
+const unsigned char RQ_FLAG_SLEEPING    = 0b00000100;
+const unsigned char RQ_FLAG_RAN         = 0b00001000;
+const unsigned char RQ_FLAG_CHANGED     = 0b00010000;
+const unsigned char RQ_FLAG_PARAMS      = 0b00100000;
+const unsigned char RQ_FLAG_NEW         = 0b01000000;
+const unsigned char RQ_FLAG_CUSTOM2     = 0b10000000;
+
+unsigned int GLOBAL_TASK_COUNT = 0;
+
+/* Every RQLL is owned by one worker. Worker 0 runs on the thread which calls
+ * schedule_run(), the others get their own thread once it starts.
+ */
+typedef struct SchedWorker {
+    ll_head *rqll;
+    pthread_t thread;
+    unsigned int id, kill_epoch, steals;
+    int spawned, wake_fd, poll_fd, idle;
+    milliseconds_t idle_until;
+    uint64_t idle_us, idle_cpu_us, wakeups;
+
+    // Per frame time allowance of the whole RQLL, 0 means unlimited
+    microseconds_t budget_us;
+    int64_t debt_us;
+    unsigned int overruns, frames;
+
+    // Lowest vruntime of the worker's RunQueues, see worker_run_frame()
+    uint64_t min_vruntime;
+
+    // Task being run since run_start_us, see scheduler_worker_running()
+    int (*run_func)(Task*, Stack64*);
+    const char *run_name;
+    uint64_t run_start_us;
+
+    // Tasks parked on poll_fd, linked through Task.timer
+    pthread_mutex_t wait_mutex;
+    TimerNode waiting;
+    unsigned int waiting_c;
+} SchedWorker;
+
+static ll_head* g_default_rqll = NULL;
+static IPQueue64* g_deadline_queue = NULL;
+static pthread_mutex_t g_deadline_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TimerWheel* g_sleep_wheel = NULL;
+static pthread_mutex_t g_sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static SchedWorker g_workers[SCHEDULER_WORKERS_MAX];
+static unsigned int g_workers_c = 0;
+static int g_workers_running = 0;
+static int g_tickless = 0;
+static int g_virtual = 0;
+static int g_task_stats = 0;
+static _Thread_local SchedWorker *t_worker = NULL;
+
+static unsigned int g_rq_ids = 0;
+
+// Incremented by scheduler_kill_all_tasks(), tasks from older epochs are dead
+static unsigned int g_kill_epoch = 0;
+
+void rq_add(RunQueue*, Task*);
+
+
+static uint64_t ts_to_us(TimeStamp *ts) {
+    return (uint64_t) ts->sec * 1000000 + ts->usec;
+}
+
+static void rq_lock(RunQueue *rq) {
+    pthread_mutex_lock(&rq->mutex);
+}
+
+static int rq_trylock(RunQueue *rq) {
+    return pthread_mutex_trylock(&rq->mutex) == 0;
+}
+
+static void rq_unlock(RunQueue *rq) {
+    pthread_mutex_unlock(&rq->mutex);
+}
+
+static int tk_killed(Task *task) {
+    return (task->flags & RQ_FLAG_KILLED)
+        || task->epoch != __atomic_load_n(&g_kill_epoch, __ATOMIC_ACQUIRE);
+}
+
+// Wakes up idle workers which would otherwise sleep past deadline
+static void wakeup_idle_workers(milliseconds_t deadline) {
+    for (int i = 0; i < g_workers_c; i++) {
+        SchedWorker *w = g_workers + i;
+
+        if (!__atomic_load_n(&w->idle, __ATOMIC_SEQ_CST)) continue;
+
+        if (deadline < __atomic_load_n(&w->idle_until, __ATOMIC_SEQ_CST))
+            arch_wakeup_fd_signal(w->wake_fd);
+    }
+}
+
+static int tracing() {
+    return __atomic_load_n(&TRACE_ENABLED, __ATOMIC_RELAXED);
+}
+
+static void trace_task(trace_event_t type, Task *task, uint64_t ts_us,
+        uint64_t dur_us) {
+
+    trace_record(type, task, t_worker ? (int) t_worker->id : -1, ts_us, dur_us);
+}
+
+static void sleep_enqueue(Task *task) {
+    if (tracing()) trace_task(TRACE_SLEEP, task, trace_now_us(), 0);
+
+    pthread_mutex_lock(&g_sleep_mutex);
+    tw_insert(g_sleep_wheel, &task->timer, task->next_run, (uint64_t) task);
+    pthread_mutex_unlock(&g_sleep_mutex);
+
+    if (g_tickless) wakeup_idle_workers(task->next_run);
+}
+
+/* Unlinks every task from the expired timer list, g_sleep_mutex must be held.
+ * Returns the tasks in expiry order, chained through Task.next.
+ */
+static Task *collect_timer_list(TimerNode *expired) {
+    Task *woken = NULL, **tail = &woken;
+
+    while (expired->next != expired) {
+        TimerNode *node = expired->next;
+        Task *stk = (Task*) node->data;
+
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->next = NULL;
+        node->prev = NULL;
+
+        stk->flags &= ~RQ_FLAG_SLEEPING;
+        stk->woken = 1;
+
+        if (tracing()) trace_task(TRACE_WAKE, stk, trace_now_us(), 0);
+
+        *tail = stk;
+        tail = &stk->next;
+    }
+
+    *tail = NULL;
+
+    return woken;
+}
+
+// Appends the chain first..last of n tasks to class prio's circular list
+static void rq_splice(RunQueue* rq, int prio, Task *first, Task *last, int n) {
+    if (rq->head[prio] == NULL || rq->tail[prio] == NULL) {
+        last->next = first;
+        rq->head[prio] = first;
+
+    } else {
+        last->next = rq->head[prio];
+        rq->tail[prio]->next = first;
+    }
+
+    rq->tail[prio] = last;
+    rq->queued[prio] += n;
+    rq->running += n;
+}
+
+/* Moves every collected task back onto its RunQueue. Tasks are sorted into
+ * chains per RunQueue and class so each RunQueue is locked once per batch.
+ */
+static void wake_task_list(Task *woken) {
+    while (woken) {
+        RunQueue *rq = woken->runqueue;
+        Task *first[TK_PRIO_C] = {NULL}, *last[TK_PRIO_C] = {NULL};
+        int n[TK_PRIO_C] = {0};
+        Task *rest = NULL, **rest_tail = &rest;
+
+        while (woken) {
+            Task *stk = woken;
+            woken = woken->next;
+
+            if (stk->runqueue != rq) {
+                *rest_tail = stk;
+                rest_tail = &stk->next;
+                continue;
+            }
+
+            int c = stk->prio;
+
+            if (last[c]) last[c]->next = stk;
+            else first[c] = stk;
+
+            last[c] = stk;
+            n[c]++;
+        }
+
+        *rest_tail = NULL;
+        woken = rest;
+
+        rq_lock(rq);
+        for (int c = 0; c < TK_PRIO_C; c++)
+            if (n[c]) rq_splice(rq, c, first[c], last[c], n[c]);
+        rq_unlock(rq);
+    }
+}
+
+static Task* create_task(Task* task, RunQueue* rq, milliseconds_t delay,
+        milliseconds_t runtime, int (*func)(Task*, Stack64*), Stack64* stack,
+        void (*callback)(Task*)) {
+
+    task->flags = '\0';
+    task->occupied = 1;
+    task->extra = 0;
+    task->extra2 = 0;
+    task->func = func;
+    task->stack = stack;
+    task->callback = callback;
+    task->next = (Task*) task;
+    task->next_run = 0;
+    task->runqueue = rq;
+    task->epoch = __atomic_load_n(&g_kill_epoch, __ATOMIC_ACQUIRE);
+    task->resume = 0;
+    task->wait_fd = -1;
+    task->events = 0;
+    task->revents = 0;
+    task->reactor = 0;
+    task->blocked = 0;
+    task->wnext = NULL;
+    task->wlist = NULL;
+    task->joiners = NULL;
+    task->timer.next = NULL;
+    task->timer.prev = NULL;
+    task->name = NULL;
+    task->woken = 0;
+    task->prio = TK_PRIO_NORMAL;
+    task->period = 0;
+    task->slack = 0;
+    task->anchor = 0;
+    memset(&task->stats, 0, sizeof(TaskStats));
+    ipq_node_init(&task->deadline);
+
+    // Threads outside the scheduler don't keep their frame clock current
+    if (t_worker == NULL) time_update();
+
+    if (runtime == 0) task->kill_time = 0;
+    else {
+        task->kill_time = TIMER_NOW_MS + runtime;
+
+        pthread_mutex_lock(&g_deadline_mutex);
+        ipq_enqueue(g_deadline_queue, &task->deadline, task->kill_time);
+        pthread_mutex_unlock(&g_deadline_mutex);
+
+        if (g_tickless) wakeup_idle_workers(task->kill_time);
+    }
+    
+    tk_sleep(task, delay);
+    __atomic_add_fetch(&GLOBAL_TASK_COUNT, 1, __ATOMIC_RELEASE);
+
+    return task;
+}
+
+static void tk_detach_locked(Task*);
+static void tk_wake_list(Task**);
+
+static void rm_task(Task* task) {
+    RunQueue *rq = task->runqueue;
+
+    if (task->kill_time) {
+        pthread_mutex_lock(&g_deadline_mutex);
+        ipq_remove(g_deadline_queue, &task->deadline);
+        pthread_mutex_unlock(&g_deadline_mutex);
+    }
+
+    // Invalidates handles, so joins can't see the next task in this slot
+    pthread_mutex_lock(&g_wait_mutex);
+    tk_detach_locked(task);
+    tk_wake_list(&task->joiners);
+    __atomic_add_fetch(&task->gen, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_wait_mutex);
+
+    task->occupied = 0;
+    task->next = rq->free;
+    rq->free = task;
+
+    // Let idle workers exit once the last task is gone
+    if (__atomic_sub_fetch(&GLOBAL_TASK_COUNT, 1, __ATOMIC_RELEASE) == 0
+            && g_tickless)
+        scheduler_wakeup();
+}
+
+static void reactor_park(Task*);
+static void tk_park_blocked(Task*);
+static void tk_detach(Task*);
+static void reactor_unpark(Task*);
+
+int tk_kill(Task* task) {
+    if (tracing() && !(task->flags & RQ_FLAG_KILLED))
+        trace_task(TRACE_KILL, task, trace_now_us(), 0);
+
+    task->flags |= RQ_FLAG_KILLED;
+
+    if (0 <= task->wait_fd) reactor_unpark(task);
+
+    if (!(task->flags & RQ_FLAG_SLEEPING)) return 0;
+
+    /* Move a sleeping task's timer to the current tick so it is reaped on
+     * the next pass instead of when it would have woken up */
+    pthread_mutex_lock(&g_sleep_mutex);
+
+    int pending = tw_pending(&task->timer);
+
+    if (pending) {
+        tw_cancel(g_sleep_wheel, &task->timer);
+        tw_insert(g_sleep_wheel, &task->timer, 0, (uint64_t) task);
+    }
+
+    pthread_mutex_unlock(&g_sleep_mutex);
+
+    if (pending && g_tickless) wakeup_idle_workers(0);
+
+    return 0;
+}
+
+// Adds a new slab of unoccupied tasks to the RunQueue's free list
+static int rq_grow(RunQueue* rq) {
+    TaskSlab *slab = malloc(RQ_MEMPOOL_SIZE);
+
+    if (slab == NULL) return -1;
+
+    int n = (RQ_MEMPOOL_SIZE - sizeof(TaskSlab)) / sizeof(Task);
+
+    for (int i = n - 1; 0 <= i; i--) {
+        Task *tk = slab->tasks + i;
+        tk->occupied = 0;
+        tk->gen = 0;
+        tk->next = rq->free;
+        rq->free = tk;
+    }
+
+    slab->next = rq->slabs;
+    rq->slabs = slab;
+    rq->max += n;
+
+    return n;
+}
+
+RunQueue* rq_init() {
+    RunQueue* rq = malloc(sizeof(RunQueue));
+
+    rq->slabs = NULL;
+    rq->free = NULL;
+    rq->max = 0;
+    rq_grow(rq);
+
+    // Recursive so tasks can schedule() onto the RunQueue they are running on
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&rq->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    rq->count = 0;
+    rq->running = 0;
+    rq->current = NULL;
+    rq->lock = 0;
+    rq->pinned = 0;
+    rq->boost = -1;
+    rq->next = NULL;
+    rq->rqll = NULL;
+    rq->budget_us = 0;
+    rq->debt_us = 0;
+    rq->overruns = 0;
+    rq->weight = RQ_WEIGHT_DEFAULT;
+    rq->vruntime = 0;
+    rq->frame = 0;
+    rq->id = __atomic_fetch_add(&g_rq_ids, 1, __ATOMIC_RELAXED);
+
+    for (int c = 0; c < TK_PRIO_C; c++) {
+        rq->head[c] = NULL;
+        rq->tail[c] = NULL;
+        rq->queued[c] = 0;
+        rq->pass[c] = 0;
+        rq->starved[c] = 0;
+        rq->misses[c] = 0;
+    }
+
+    rq->inbox = malloc(sizeof(RQInbox));
+    rq->inbox->head = 0;
+    rq->inbox->tail = 0;
+
+    for (unsigned int i = 0; i < RQ_INBOX_SIZE; i++)
+        rq->inbox->cells[i].seq = i;
+
+    return rq;
+}
+
+void rq_free(RunQueue* rq) {
+    TaskSlab *slab = rq->slabs;
+
+    while (slab != NULL) {
+        TaskSlab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    free(rq->inbox);
+    pthread_mutex_destroy(&rq->mutex);
+    free(rq);
+}
+
+int rq_empty(RunQueue* rq) {
+    return rq->count <= 0;
+}
+
+int rq_full(RunQueue* rq) {
+    return rq->max <= rq->count;
+}
+
+// Tasks are added behind the current pass, so they first run next frame
+void rq_add(RunQueue* rq, Task *tk) {
+    rq_splice(rq, tk->prio, tk, tk, 1);
+}
+
+/* Starts a new pass over every runnable task. A class which was cut off by
+ * the budget for RQ_AGING_FRAMES passes in a row runs first in this one.
+ */
+static void rq_begin_pass(RunQueue* rq) {
+    rq->boost = -1;
+
+    for (int c = 0; c < TK_PRIO_C; c++) {
+        if (rq->pass[c] == 0) rq->starved[c] = 0;
+
+        else if (RQ_AGING_FRAMES <= ++rq->starved[c] && rq->boost < 0) {
+            rq->boost = c;
+            rq->starved[c] = 0;
+        }
+
+        rq->pass[c] = rq->queued[c];
+    }
+}
+
+// Class of the task which runs next, -1 if there are none
+static int rq_next_prio(RunQueue* rq) {
+    if (rq->running == 0) return -1;
+
+    for (int i = 0; i < 2; i++) {
+        if (0 <= rq->boost && rq->pass[rq->boost]) return rq->boost;
+
+        for (int c = 0; c < TK_PRIO_C; c++)
+            if (rq->pass[c]) return c;
+
+        rq_begin_pass(rq);
+    }
+
+    return -1;
+}
+
+Task* rq_create(RunQueue* rq, milliseconds_t delay, milliseconds_t runtime,
+        int (*func)(Task*, Stack64*), Stack64* stack, void (*callback)(Task*),
+        TaskHandle *handle) {
+
+    if (rq == NULL) return NULL;
+
+    rq_lock(rq);
+
+    if (rq->free == NULL && rq_grow(rq) < 0) {
+        rq_unlock(rq);
+        return NULL;
+    }
+
+    Task* tk = rq->free;
+    rq->free = tk->next;
+
+    create_task(tk, rq, delay, runtime, func, stack, callback);
+    rq->count++;
+
+    // Taken under the lock since the task may finish as soon as it's released
+    if (handle) *handle = tk_handle(tk);
+
+    // Delayed tasks start on the sleep queue instead of the RunQueue
+    if (tk->flags & RQ_FLAG_SLEEPING) {
+        rq_unlock(rq);
+        sleep_enqueue(tk);
+        return tk;
+    }
+
+    rq_add(rq, tk);
+    rq_unlock(rq);
+
+    if (g_tickless) wakeup_idle_workers(TIMER_NEVER_MS);
+
+    return tk;
+}
+
+static Task *rq_pop_prio(RunQueue* rq, int c) {
+    Task* old = rq->head[c];
+
+    if (old == NULL || !old->occupied) return NULL;
+
+    if (rq->head[c] == rq->tail[c]) {
+        rq->head[c] = NULL;
+        rq->tail[c] = NULL;
+
+    } else {
+        rq->head[c] = rq->head[c]->next;
+        rq->tail[c]->next = rq->head[c];
+    }
+
+    if (rq->pass[c]) rq->pass[c]--;
+    rq->queued[c]--;
+    rq->running--;
+
+    return old;
+}
+
+Task *rq_pop(RunQueue* rq) {
+    if (rq == NULL || rq_empty(rq)) return NULL;
+
+    int c = rq_next_prio(rq);
+
+    return c < 0 ? NULL : rq_pop_prio(rq, c);
+}
+
+// The callback runs with rq unlocked, it may schedule onto any RunQueue
+static void rq_reap(RunQueue* rq, Task *tk) {
+    if (tk->callback)
+        tk->callback(tk);
+
+    rq_lock(rq);
+    rq->count--;
+    rm_task(tk);
+    rq_unlock(rq);
+}
+
+/* Earliest time within [deadline, deadline + slack] on a power of two
+ * boundary no larger than slack, so a wakeup is deferred no more than needed.
+ * Timers whose windows overlap mostly end up on the same tick and are woken
+ * together.
+ */
+static milliseconds_t tk_coalesce(milliseconds_t deadline, milliseconds_t slack) {
+    milliseconds_t granularity = 1;
+
+    while (granularity * 2 <= slack) granularity *= 2;
+
+    return (deadline + granularity - 1) & ~(granularity - 1);
+}
+
+/* Puts a periodic task to sleep until its next period, relative to the
+ * previous deadline instead of to when it ran so it doesn't drift. Periods
+ * which have already passed are skipped.
+ */
+static void tk_rearm(Task *task) {
+    milliseconds_t now = TIMER_NOW_MS;
+
+    task->anchor += task->period;
+
+    if (task->anchor < now)
+        task->anchor += ((now - task->anchor) / task->period + 1) * task->period;
+
+    task->next_run = tk_coalesce(task->anchor, task->slack);
+    task->flags |= RQ_FLAG_SLEEPING;
+}
+
+static int tk_missed(Task *task) {
+    if (time_ms_delta(TIMER_NOW_MS, task->next_run) <= RQ_DEADLINE_SLACK_MS)
+        return 0;
+
+    __atomic_add_fetch(&task->runqueue->misses[task->prio], 1, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+// The task neither went to sleep, nor waits on anything, nor was killed
+static int tk_idle_after_run(Task *task) {
+    return !(task->flags & RQ_FLAG_SLEEPING) && task->wait_fd < 0
+        && !task->blocked && !tk_killed(task);
+}
+
+static void tk_record_lateness(Task *task) {
+    TaskStats *stats = &task->stats;
+    TimeStamp now;
+
+    time_now(&now);
+
+    int64_t late_ms = time_ms_delta(time_to_ms(&now), task->next_run);
+    int64_t late_us = late_ms * 1000 + now.usec % 1000;
+    if (late_us < 0) late_us = 0;
+
+    stats->wakes++;
+    stats->late_total_us += late_us;
+    if (stats->max_late_us < late_us) stats->max_late_us = late_us;
+}
+
+/* Runs Task.func, recording its runtime and, if a timer woke it, how late it
+ * ran when task accounting, the watchdog or tracing are enabled. Periodic
+ * tasks are re-armed here. */
+static void tk_call(Task *task) {
+    int stats = __atomic_load_n(&g_task_stats, __ATOMIC_RELAXED);
+    microseconds_t threshold = __atomic_load_n(&WATCHDOG_US, __ATOMIC_RELAXED);
+    uint64_t trace_us = tracing() ? trace_now_us() : 0;
+
+    if (task->woken) {
+        if (tk_missed(task) && stats) task->stats.misses++;
+        if (stats) tk_record_lateness(task);
+
+        task->woken = 0;
+    }
+
+    if (!stats && !threshold && !__atomic_load_n(&WATCHDOG_STUCK_MS, __ATOMIC_RELAXED)) {
+        task->func(task, task->stack);
+
+    } else {
+        SchedWorker *self = t_worker;
+        uint64_t start_us = arch_fast_clock_ns() / 1000;
+
+        if (self) {
+            __atomic_store_n(&self->run_func, task->func, __ATOMIC_RELAXED);
+            __atomic_store_n(&self->run_name, task->name, __ATOMIC_RELAXED);
+            __atomic_store_n(&self->run_start_us, start_us, __ATOMIC_RELEASE);
+        }
+
+        task->func(task, task->stack);
+
+        if (self) __atomic_store_n(&self->run_start_us, 0, __ATOMIC_RELEASE);
+
+        uint64_t us = arch_fast_clock_ns() / 1000 - start_us;
+
+        if (stats) {
+            task->stats.calls++;
+            task->stats.total_us += us;
+            if (task->stats.max_us < us) task->stats.max_us = us;
+        }
+
+        if (threshold && threshold <= us)
+            watchdog_record(task, self ? self->id : 0, start_us, us);
+    }
+
+    if (trace_us)
+        trace_task(TRACE_RUN, task, trace_us, trace_now_us() - trace_us);
+
+    if (task->period && tk_idle_after_run(task)) tk_rearm(task);
+}
+
+/* Hands a task which is off its RunQueue back once Task.func returned: reaps
+ * it, parks it or puts it behind the others of its class. Returns 1 if it was
+ * reaped.
+ */
+static int tk_return(Task *tk) {
+    RunQueue *rq = tk->runqueue;
+
+    // Reap right away, a dead task left runnable keeps its worker out of idle
+    if (tk_killed(tk)) {
+        rq_reap(rq, tk);
+        return 1;
+
+    } else if (tk->flags & RQ_FLAG_SLEEPING) {
+        sleep_enqueue(tk);
+
+    // Unlinked until its fd is ready
+    } else if (0 <= tk->wait_fd) {
+        reactor_park(tk);
+
+    } else if (tk->blocked) {
+        tk_park_blocked(tk);
+
+    } else {
+        rq_lock(rq);
+        rq_add(rq, tk);
+        rq_unlock(rq);
+    }
+
+    return 0;
+}
+
+/* Runs the next task of rq. It is taken off its list and rq is unlocked while
+ * Task.func runs, so the task may lock any other RunQueue and other workers
+ * can wake tasks onto rq in the meantime.
+ */
+int rq_run(RunQueue* rq) {
+    if (rq == NULL) return -1;
+
+    rq_lock(rq);
+
+    int c = rq_next_prio(rq);
+    Task* current = c < 0 ? NULL : rq->head[c];
+
+    if (current == NULL || !current->occupied) {
+        rq_unlock(rq);
+        return -1;
+    }
+
+    // Woken up by a timeout or a kill instead of its future
+    if (current->blocked) tk_detach(current);
+
+    rq_pop_prio(rq, c);
+    rq->current = current;
+    rq_unlock(rq);
+
+    if (!tk_killed(current))
+        tk_call(current);
+
+    rq_lock(rq);
+    rq->current = NULL;
+    rq_unlock(rq);
+
+    return tk_return(current);
+}
+
+void tk_set_name(Task* task, const char* name) {
+    task->name = name;
+}
+
+/* Makes the task run every period ms, starting one period from now, without
+ * calling tk_sleep(). Each wakeup may be deferred by up to slack ms so it can
+ * share a tick with other timers. A period of 0 stops it.
+ */
+void tk_set_period(Task* task, milliseconds_t period, milliseconds_t slack) {
+    if (task->period == period && task->slack == slack) return;
+
+    task->period = period;
+    task->slack = slack;
+    task->anchor = TIMER_NOW_MS;
+}
+
+// Takes effect the next time the task is queued
+void tk_set_priority(Task* task, tk_prio_t prio) {
+    if (prio < TK_PRIO_C) task->prio = prio;
+}
+
+/* Only marks the task, the RunQueue moves it onto the sleep queue once the
+ * task returns from Task.func or, for new tasks, in rq_create().
+ */
+void tk_sleep(Task* task, milliseconds_t ms) {
+    if (ms < 1) return;
+
+    if (task->flags & RQ_FLAG_SLEEPING)
+        log_debug("Warning: putting already sleeping task %p to sleep", task);
+
+    task->next_run = TIMER_NOW_MS + ms;
+    task->flags |= RQ_FLAG_SLEEPING;
+}
+
+static SchedWorker *scheduler_new_worker(ll_head *rqll) {
+    if (SCHEDULER_WORKERS_MAX <= g_workers_c) return NULL;
+
+    SchedWorker *w = g_workers + g_workers_c;
+
+    w->rqll = rqll;
+    w->id = g_workers_c++;
+    w->kill_epoch = __atomic_load_n(&g_kill_epoch, __ATOMIC_ACQUIRE);
+    w->steals = 0;
+    w->spawned = 0;
+    w->idle = 0;
+    w->idle_until = 0;
+    w->idle_us = 0;
+    w->idle_cpu_us = 0;
+    w->wakeups = 0;
+    w->wake_fd = arch_wakeup_fd_init();
+    w->budget_us = 0;
+    w->debt_us = 0;
+    w->overruns = 0;
+    w->frames = 0;
+    w->min_vruntime = 0;
+    w->run_func = NULL;
+    w->run_name = NULL;
+    w->run_start_us = 0;
+
+    pthread_mutex_init(&w->wait_mutex, NULL);
+    tw_list_init(&w->waiting);
+    w->waiting_c = 0;
+    w->poll_fd = arch_poller_init();
+
+    if (0 <= w->poll_fd && 0 <= w->wake_fd)
+        arch_poller_add(w->poll_fd, w->wake_fd, ARCH_POLL_IN, NULL);
+
+    return w;
+}
+
+static SchedWorker *scheduler_get_worker(ll_head *rqll) {
+    for (int i = 0; i < g_workers_c; i++)
+        if (g_workers[i].rqll == rqll) return g_workers + i;
+
+    return NULL;
+}
+
+
+/* Reactor
+ * Every worker watches the fds its tasks wait on. A parked task is never on
+ * the timer wheel, so its TimerNode links it on the worker's waiting list
+ * for kill-all. Lock order is RQ -> wait_mutex, parked tasks are moved back
+ * to their RunQueue after wait_mutex is released.
+ */
+/* Like tk_sleep() the task is only parked once it returns from Task.func, it
+ * runs again when fd has any of events ready and Task.revents says which.
+ * Only one task may wait on an fd at a time and a task can't both sleep and
+ * wait. If fd can't be watched the task runs again with ARCH_POLL_ERR set.
+ */
+int tk_wait_fd(Task* task, int fd, unsigned int events) {
+    if (fd < 0 || (task->flags & RQ_FLAG_SLEEPING)) return -1;
+
+    SchedWorker *w = scheduler_get_worker(task->runqueue->rqll);
+
+    if (w == NULL) return -1;
+
+    task->wait_fd = fd;
+    task->events = events;
+    task->revents = 0;
+    task->reactor = w->id;
+
+    return 0;
+}
+
+static void tk_unlink_waiting(SchedWorker *w, Task *task) {
+    arch_poller_del(w->poll_fd, task->wait_fd);
+
+    task->timer.prev->next = task->timer.next;
+    task->timer.next->prev = task->timer.prev;
+    task->timer.next = NULL;
+    task->timer.prev = NULL;
+    task->wait_fd = -1;
+    w->waiting_c--;
+}
+
+static void tk_requeue(Task *task) {
+    rq_lock(task->runqueue);
+    rq_add(task->runqueue, task);
+    rq_unlock(task->runqueue);
+}
+
+static void reactor_park(Task *task) {
+    SchedWorker *w = g_workers + task->reactor;
+
+    pthread_mutex_lock(&w->wait_mutex);
+
+    int parked = !tk_killed(task) && arch_poller_add(w->poll_fd,
+            task->wait_fd, task->events, task) == 0;
+
+    if (parked) {
+        TimerNode *head = &w->waiting;
+
+        task->timer.next = head;
+        task->timer.prev = head->prev;
+        head->prev->next = &task->timer;
+        head->prev = &task->timer;
+        w->waiting_c++;
+
+    } else {
+        if (!tk_killed(task)) {
+            log_debug("Failed to wait on fd %d for task %p", task->wait_fd, task);
+            task->revents = ARCH_POLL_ERR;
+        }
+
+        task->wait_fd = -1;
+    }
+
+    pthread_mutex_unlock(&w->wait_mutex);
+
+    if (!parked) tk_requeue(task);
+}
+
+// Makes a parked task runnable again so a kill can be processed
+static void reactor_unpark(Task *task) {
+    SchedWorker *w = g_workers + task->reactor;
+
+    pthread_mutex_lock(&w->wait_mutex);
+
+    int parked = 0 <= task->wait_fd && task->timer.next != NULL;
+
+    if (parked) tk_unlink_waiting(w, task);
+
+    pthread_mutex_unlock(&w->wait_mutex);
+
+    if (parked) {
+        tk_requeue(task);
+
+        if (g_tickless) wakeup_idle_workers(0);
+    }
+}
+
+// Requeues every parked task of this worker which was killed by an epoch
+static void reactor_unpark_killed(SchedWorker *self) {
+    Task *woken = NULL;
+
+    pthread_mutex_lock(&self->wait_mutex);
+
+    TimerNode *node = self->waiting.next;
+
+    while (node != &self->waiting) {
+        Task *task = (Task*) ((char*) node - offsetof(Task, timer));
+        node = node->next;
+
+        if (!tk_killed(task)) continue;
+
+        tk_unlink_waiting(self, task);
+        task->next = woken;
+        woken = task;
+    }
+
+    pthread_mutex_unlock(&self->wait_mutex);
+
+    wake_task_list(woken);
+}
+
+/* Waits for the worker's fds until deadline, or only checks them if deadline
+ * is NULL. Ready tasks are moved back onto their RunQueues. Returns the number
+ * of ready fds, counting the wakeup fd.
+ */
+static int reactor_poll(SchedWorker *self, TimeStamp *deadline) {
+    ArchPollEvent events[REACTOR_EVENTS_MAX];
+    Task *woken = NULL, **tail = &woken;
+
+    int n = arch_poller_wait(self->poll_fd, deadline, events, REACTOR_EVENTS_MAX);
+
+    pthread_mutex_lock(&self->wait_mutex);
+
+    for (int i = 0; i < n; i++) {
+        Task *task = (Task*) events[i].data;
+
+        if (task == NULL) {
+            arch_wakeup_fd_clear(self->wake_fd);
+            self->wakeups++;
+            continue;
+        }
+
+        // Already unparked by a kill
+        if (task->wait_fd < 0 || task->timer.next == NULL) continue;
+
+        tk_unlink_waiting(self, task);
+        task->revents = events[i].events;
+
+        *tail = task;
+        tail = &task->next;
+    }
+
+    *tail = NULL;
+
+    pthread_mutex_unlock(&self->wait_mutex);
+
+    wake_task_list(woken);
+
+    return n;
+}
+
+
+/* Futures and Joins
+ * A blocked task is parked on the timer wheel until its timeout, so kills and
+ * kill-all reach it like any sleeping task. Resolving a future moves its
+ * waiters' timers to the current tick. See Locking at the top for the lock
+ * order.
+ */
+
+// Unlinks a task from the waiter list it is on, g_wait_mutex must be held
+static void tk_detach_locked(Task *task) {
+    Task **p = task->wlist;
+
+    while (p && *p) {
+        if (*p == task) {
+            *p = task->wnext;
+            break;
+        }
+
+        p = &(*p)->wnext;
+    }
+
+    task->wnext = NULL;
+    task->wlist = NULL;
+    task->blocked = 0;
+}
+
+static void tk_detach(Task *task) {
+    pthread_mutex_lock(&g_wait_mutex);
+    tk_detach_locked(task);
+    pthread_mutex_unlock(&g_wait_mutex);
+}
+
+// Wakes every task on list, g_wait_mutex must be held
+static void tk_wake_list(Task **list) {
+    Task *task = *list;
+    int woken = 0;
+
+    *list = NULL;
+
+    while (task) {
+        Task *next = task->wnext;
+
+        // Still on its RunQueue if it hasn't returned from Task.func yet
+        if (task->blocked == 2) {
+            pthread_mutex_lock(&g_sleep_mutex);
+
+            if (tw_pending(&task->timer)) {
+                tw_cancel(g_sleep_wheel, &task->timer);
+                tw_insert(g_sleep_wheel, &task->timer, 0, (uint64_t) task);
+                woken = 1;
+            }
+
+            pthread_mutex_unlock(&g_sleep_mutex);
+        }
+
+        task->wnext = NULL;
+        task->wlist = NULL;
+        task->blocked = 0;
+        task = next;
+    }
+
+    if (woken && g_tickless) wakeup_idle_workers(0);
+}
+
+// g_wait_mutex must be held
+static void tk_block(Task *task, Task **list, milliseconds_t timeout) {
+    task->wnext = *list;
+    task->wlist = list;
+    task->blocked = 1;
+    task->next_run = timeout ? TIMER_NOW_MS + timeout : TIMER_NEVER_MS;
+    *list = task;
+}
+
+// Called once a blocked task is unlinked from its RunQueue
+static void tk_park_blocked(Task *task) {
+    pthread_mutex_lock(&g_wait_mutex);
+
+    int parked = task->blocked == 1 && !tk_killed(task);
+
+    if (parked) {
+        task->blocked = 2;
+        task->flags |= RQ_FLAG_SLEEPING;
+        sleep_enqueue(task);
+
+    } else {
+        tk_detach_locked(task);
+    }
+
+    pthread_mutex_unlock(&g_wait_mutex);
+
+    if (!parked) tk_requeue(task);
+}
+
+TaskHandle tk_handle(Task *task) {
+    TaskHandle handle = {task, 0};
+
+    if (task) handle.gen = __atomic_load_n(&task->gen, __ATOMIC_ACQUIRE);
+
+    return handle;
+}
+
+int tk_alive(TaskHandle handle) {
+    return handle.task && handle.task->occupied
+        && __atomic_load_n(&handle.task->gen, __ATOMIC_ACQUIRE) == handle.gen;
+}
+
+/* Like tk_sleep() this only takes effect once the task returns from
+ * Task.func. Returns 1 if the other task is already gone, 0 if the task
+ * will block until it is or until timeout runs out (0 waits forever).
+ */
+int tk_join(Task *task, TaskHandle handle, milliseconds_t timeout) {
+    if (handle.task == task) return 1;
+
+    pthread_mutex_lock(&g_wait_mutex);
+
+    int done = !tk_alive(handle);
+
+    if (!done) tk_block(task, &handle.task->joiners, timeout);
+
+    pthread_mutex_unlock(&g_wait_mutex);
+
+    return done;
+}
+
+void fut_init(Future *fut) {
+    fut->value = 0;
+    fut->ready = 0;
+    fut->waiters = NULL;
+}
+
+void fut_set(Future *fut, uint64_t value) {
+    pthread_mutex_lock(&g_wait_mutex);
+
+    fut->value = value;
+    __atomic_store_n(&fut->ready, 1, __ATOMIC_RELEASE);
+    tk_wake_list(&fut->waiters);
+
+    pthread_mutex_unlock(&g_wait_mutex);
+}
+
+void fut_reset(Future *fut) {
+    __atomic_store_n(&fut->ready, 0, __ATOMIC_RELEASE);
+}
+
+int fut_ready(Future *fut) {
+    return __atomic_load_n(&fut->ready, __ATOMIC_ACQUIRE);
+}
+
+uint64_t fut_get(Future *fut) {
+    return fut->value;
+}
+
+// Same semantics as tk_join()
+int tk_await(Task *task, Future *fut, milliseconds_t timeout) {
+    pthread_mutex_lock(&g_wait_mutex);
+
+    int done = fut->ready;
+
+    if (!done) tk_block(task, &fut->waiters, timeout);
+
+    pthread_mutex_unlock(&g_wait_mutex);
+
+    return done;
+}
+
+ll_head* scheduler_init() {
+    ll_head* rqll = ll_init(1);
+    
+    // Initialize internal timer wheel of sleeping tasks
+    if (g_sleep_wheel == NULL) {
+        g_sleep_wheel = tw_init(TIMER_NOW_MS);
+    }
+
+    // Initialize internal heap of time limited tasks
+    if (g_deadline_queue == NULL) {
+        g_deadline_queue = ipq_init(1);
+    }
+
+    g_workers_c = 0;
+    scheduler_new_worker(rqll);
+
+    g_default_rqll = rqll;
+    return rqll;
+}
+
+ll_head *scheduler_new_rqll() {
+    if (SCHEDULER_WORKERS_MAX <= g_workers_c) return NULL;
+
+    ll_head *rqll = ll_init(1);
+    scheduler_new_worker(rqll);
+
+    return rqll;
+}
+
+void scheduler_free() {
+    watchdog_monitor(0);
+    parallel_free();
+    trace_free();
+
+    SchedulerIdleStats stats;
+    scheduler_idle_stats(&stats);
+
+    log_debug("Scheduler: idle for %" PRIu64 "ms using %" PRIu64 "us CPU "
+            "(%" PRIu64 "ms CPU per idle hour, %" PRIu64 " wakeups)",
+            stats.idle_us / 1000, stats.idle_cpu_us,
+            stats.cpu_ms_per_idle_hour, stats.wakeups);
+
+    for (int i = 0; i < g_workers_c; i++) {
+        if (0 <= g_workers[i].wake_fd) close(g_workers[i].wake_fd);
+
+        arch_poller_free(g_workers[i].poll_fd);
+        pthread_mutex_destroy(&g_workers[i].wait_mutex);
+    }
+
+    if (g_sleep_wheel != NULL)
+        tw_free(g_sleep_wheel);
+
+    if (g_deadline_queue != NULL)
+        ipq_free(g_deadline_queue);
+
+    g_sleep_wheel = NULL;
+    g_deadline_queue = NULL;
+    g_workers_c = 0;
+}
+
+// TODO: Keep track of all rqll's via global variable
+void scheduler_free_rqll(ll_head* rqll) {
+    if (rqll == NULL) return;
+
+    ll_node* node = rqll->node;
+
+    if (node == NULL || node->data == NULL) return;
+    RunQueue* rq = (RunQueue*) node->data;
+
+    while (rq != NULL) {
+        RunQueue* prev = rq;
+        rq = rq->next;
+        rq_free(prev);
+        prev = rq;
+    }
+
+    free(rqll);
+    rqll = NULL;
+}
+
+
+/* TODO: Rewrite tasks & runqueues to use ll_head
+ *  This is a mess because rqll is ll_head and RunQueue is a separate linked
+ *  list implementation; first the RunQueue is added to rqll list, then it must
+ *  be added to the RunQueue list
+ */
+RunQueue* scheduler_new_rq_(ll_head* rqll) {
+
+    // 1. Insert into rqll (type ll_head)
+    RunQueue* new_rq = rq_init();
+    new_rq->rqll = rqll;
+    ll_insert(rqll, new_rq);
+
+    // 2. Insert into the RunQueue structure
+    RunQueue* rq = (RunQueue*) rqll->tail->data;
+    rq->next = new_rq;
+
+    
+    rq->next = new_rq;
+    return new_rq;
+}
+
+RunQueue* scheduler_new_rq() {
+    return scheduler_new_rq_(g_default_rqll);
+}
+
+/* Pinned RunQueues are only ever run by the worker owning rqll, their tasks
+ * are never stolen. Should be called before schedule_run() starts the workers.
+ */
+int rq_pin(RunQueue* rq, ll_head* rqll) {
+    if (rq == NULL || rqll == NULL) return -1;
+
+    if (g_workers_running)
+        log_debug("Warning: pinning RunQueue %p while workers are running", rq);
+
+    if (rq->rqll != rqll) {
+        if (rq->rqll) ll_rm(rq->rqll, rq);
+
+        if (ll_insert(rqll, rq) != 0) return -1;
+        rq->rqll = rqll;
+    }
+
+    rq->pinned = 1;
+
+    return 0;
+}
+
+void rq_unpin(RunQueue* rq) {
+    rq->pinned = 0;
+}
+
+// A RunQueue's share of its worker is its weight over the sum of all weights
+void rq_set_weight(RunQueue* rq, unsigned int weight) {
+    rq->weight = weight < 1 ? 1 : weight;
+}
+
+void rq_set_budget(RunQueue* rq, microseconds_t us) {
+    rq->budget_us = us;
+    rq->debt_us = 0;
+}
+
+int scheduler_set_rqll_budget(ll_head* rqll, microseconds_t us) {
+    SchedWorker *w = scheduler_get_worker(rqll);
+
+    if (w == NULL) return -1;
+
+    w->budget_us = us;
+    w->debt_us = 0;
+
+    return 0;
+}
+
+unsigned int scheduler_rqll_overruns(ll_head* rqll) {
+    SchedWorker *w = scheduler_get_worker(rqll);
+
+    return w ? w->overruns : 0;
+}
+
+int scheduler_wake_tasks() {
+    TimerNode expired;
+    tw_list_init(&expired);
+
+    // Collect due tasks first so no RunQueue is locked with the sleep queue
+    pthread_mutex_lock(&g_sleep_mutex);
+    int i = tw_advance(g_sleep_wheel, TIMER_NOW_MS, &expired);
+    Task *woken = collect_timer_list(&expired);
+    pthread_mutex_unlock(&g_sleep_mutex);
+
+    wake_task_list(woken);
+
+    return i;
+}
+
+/* Kills every task of rq. They are found through its slabs rather than its
+ * lists, which miss the running task, sleeping and parked ones and those
+ * another worker stole. A stolen task sees the flag once its Task.func
+ * returns and is reaped when it is handed back, see tk_return().
+ */
+int rq_kill_all_tasks(RunQueue* rq) {
+    if (!rq) return -1;
+
+    rq_lock(rq);
+
+    int count = 0;
+
+    for (TaskSlab *slab = rq->slabs; slab; slab = slab->next) {
+        int n = (RQ_MEMPOOL_SIZE - sizeof(TaskSlab)) / sizeof(Task);
+
+        for (int i = 0; i < n; i++) {
+            Task *task = slab->tasks + i;
+
+            if (task->occupied && !(task->flags & RQ_FLAG_KILLED)) {
+                tk_kill(task);
+                count++;
+            }
+        }
+    }
+
+    rq_unlock(rq);
+
+    return count;
+}
+
+/* TODO: Currently doesn't iterate RunQueueLists (rqll) because they are not
+ * tracked in any way other than g_default_rqll and g_sleeping_tasks
+ */
+int kill_rqll(ll_head* rqll) {
+    if (ll_empty(rqll)) return -1;
+
+    int count = 0;
+    ll_node* node = rqll->node;
+
+    // Iterate all RunQueues on list
+    for (int i = 0; i < rqll->count; i++) {
+        RunQueue* rq = (RunQueue*) node->data;
+
+        count += rq_kill_all_tasks(rq);
+
+        node = node->next;
+    }
+
+    return count;
+}
+
+/* Safe to call from any thread or task. Tasks created before the call are
+ * treated as killed, sleeping ones are woken up and reaped by the workers.
+ */
+int scheduler_kill_all_tasks() {
+    __atomic_add_fetch(&g_kill_epoch, 1, __ATOMIC_ACQ_REL);
+
+    return __atomic_load_n(&GLOBAL_TASK_COUNT, __ATOMIC_ACQUIRE);
+}
+
+// Force wake all sleeping tasks so they can be reaped
+static int wake_killed_tasks() {
+    TimerNode expired;
+    tw_list_init(&expired);
+
+    pthread_mutex_lock(&g_sleep_mutex);
+    int i = tw_expire_all(g_sleep_wheel, &expired);
+    Task *woken = collect_timer_list(&expired);
+    pthread_mutex_unlock(&g_sleep_mutex);
+
+    wake_task_list(woken);
+
+    return i;
+}
+
+void scheduler_set_tickless(int enabled) {
+    g_tickless = enabled;
+}
+
+// Async-signal-safe
+void scheduler_wakeup() {
+    for (int i = 0; i < g_workers_c; i++)
+        arch_wakeup_fd_signal(g_workers[i].wake_fd);
+}
+
+void scheduler_idle_stats(SchedulerIdleStats *stats) {
+    stats->idle_us = 0;
+    stats->idle_cpu_us = 0;
+    stats->wakeups = 0;
+
+    for (int i = 0; i < g_workers_c; i++) {
+        stats->idle_us += g_workers[i].idle_us;
+        stats->idle_cpu_us += g_workers[i].idle_cpu_us;
+        stats->wakeups += g_workers[i].wakeups;
+    }
+
+    uint64_t idle_ms = stats->idle_us / 1000;
+    stats->cpu_ms_per_idle_hour = idle_ms == 0 ? 0
+        : stats->idle_cpu_us * 3600 / idle_ms;
+}
+
+/* Introspection
+ * Task accounting costs two clock reads per run, so it is off by default.
+ */
+void scheduler_set_task_stats(int enabled) {
+    __atomic_store_n(&g_task_stats, enabled, __ATOMIC_RELAXED);
+}
+
+int scheduler_task_stats_enabled() {
+    return __atomic_load_n(&g_task_stats, __ATOMIC_RELAXED);
+}
+
+static char tk_state(Task *task) {
+    if (tk_killed(task)) return 'K';
+    if (task->blocked) return 'B';
+    if (0 <= task->wait_fd) return 'W';
+    if (task->flags & RQ_FLAG_SLEEPING) return 'S';
+
+    return 'R';
+}
+
+/* Fills out with up to max live tasks of every worker and returns how many
+ * there are in total. Stats of a task running on another worker may be torn.
+ */
+int scheduler_task_info(TaskInfo *out, int max) {
+    int total = 0;
+
+    for (int i = 0; i < g_workers_c; i++) {
+        ll_head *rqll = g_workers[i].rqll;
+
+        for (ll_node *node = rqll->node; node && node->data; node = node->next) {
+            RunQueue *rq = (RunQueue*) node->data;
+            rq_lock(rq);
+
+            for (TaskSlab *slab = rq->slabs; slab; slab = slab->next) {
+                int n = (RQ_MEMPOOL_SIZE - sizeof(TaskSlab)) / sizeof(Task);
+
+                for (int j = 0; j < n; j++) {
+                    Task *tk = slab->tasks + j;
+
+                    if (!tk->occupied) continue;
+
+                    if (total < max) {
+                        TaskInfo *info = out + total;
+                        info->task = tk;
+                        info->runqueue = rq;
+                        info->worker = g_workers[i].id;
+                        info->name = tk->name;
+                        info->func = tk->func;
+                        info->flags = tk->flags;
+                        info->prio = tk->prio;
+                        info->state = tk_state(tk);
+                        info->next_run = tk->next_run;
+                        info->stats = tk->stats;
+                    }
+
+                    total++;
+                }
+            }
+
+            rq_unlock(rq);
+        }
+    }
+
+    return total;
+}
+
+// Most total runtime first
+static int cmp_task_info(const void *a, const void *b) {
+    uint64_t x = ((const TaskInfo*) a)->stats.total_us;
+    uint64_t y = ((const TaskInfo*) b)->stats.total_us;
+
+    return (x < y) - (x > y);
+}
 
+void scheduler_sort_task_info(TaskInfo *infos, int n) {
+    qsort(infos, n, sizeof(TaskInfo), cmp_task_info);
+}
 
-const unsigned char RQ_FLAG_BIT         = 0b00000001;
-const unsigned char RQ_FLAG_KILLED      = 0b00000010;
-const unsigned char RQ_FLAG_SLEEPING    = 0b00000100;
-const unsigned char RQ_FLAG_RAN         = 0b00001000;
-const unsigned char RQ_FLAG_CHANGED     = 0b00010000;
-const unsigned char RQ_FLAG_PARAMS      = 0b00100000;
-const unsigned char RQ_FLAG_NEW         = 0b01000000;
-const unsigned char RQ_FLAG_CUSTOM2     = 0b10000000;
+void scheduler_dump_tasks(FILE *f) {
+    int n = scheduler_task_info(NULL, 0);
+    TaskInfo *infos = malloc(sizeof(TaskInfo) * (n ? n : 1));
 
-unsigned int GLOBAL_TASK_COUNT = 0;
+    // Tasks may have been created in the meantime
+    int total = scheduler_task_info(infos, n);
+    if (total < n) n = total;
 
-static ll_head* g_default_rqll = NULL;
-static ll_head* g_dying_tasks = NULL;
-static PQueue64* g_sleep_queue = NULL;
+    scheduler_sort_task_info(infos, n);
 
+    fprintf(f, "%-4s %-18s %-24s %2s %2s %10s %10s %8s %8s %8s %6s\n",
+            "WRK", "RUNQUEUE", "TASK", "ST", "PR", "CALLS",
+            "TOTAL_US", "MAX_US", "LATE_US", "MAXLATE", "MISSES");
 
-static Task* create_task(Task* task, RunQueue* rq, int delay, int runtime,
-        int (*func)(Task*, Stack64*), Stack64* stack, void (*callback)(Task*)) {
+    for (int i = 0; i < n; i++) {
+        TaskInfo *info = infos + i;
+        TaskStats *st = &info->stats;
+        char name[32];
 
-    task->flags = '\0';
-    task->occupied = 1;
-    task->func = func;
-    task->stack = stack;
-    task->callback = callback;
-    task->next = (Task*) task;
-    task->next_run = 0;
-    task->runqueue = rq;
+        if (info->name) snprintf(name, sizeof(name), "%s", info->name);
+        else arch_symbol_name((void*) info->func, name, sizeof(name));
 
-    if (runtime < 1) task->kill_time = 0;
-    else {
-        task->kill_time = TIMER_NOW_MS + runtime;
-        ll_insert(g_dying_tasks, task);
+        fprintf(f, "%-4u %-18p %-24s %2c %2u %10" PRIu64 " %10" PRIu64
+                " %8" PRIu32 " %8" PRIu64 " %8" PRIu32 " %6u\n",
+                info->worker, (void*) info->runqueue, name, info->state,
+                info->prio, st->calls, st->total_us, st->max_us,
+                st->wakes ? st->late_total_us / st->wakes : 0,
+                st->max_late_us, st->misses);
     }
-    
-    tk_sleep(task, delay);
-    GLOBAL_TASK_COUNT++;
 
-    return task;
+    free(infos);
 }
 
-static void rm_task(Task* task) {
-    task->occupied = 0;
-    GLOBAL_TASK_COUNT--;
-}
+/* Start of the Task.func run in progress on worker in us with its function
+ * and name, 0 if the worker isn't running one or task timing is off. Used by
+ * the watchdog monitor, func and name may be torn from a run which just ended.
+ */
+uint64_t scheduler_worker_running(unsigned int worker,
+        int (**func)(Task*, Stack64*), const char **name) {
 
-int tk_kill(Task* task) {
-    task->flags |= RQ_FLAG_KILLED;
-    return 0;
+    if (g_workers_c <= worker) return 0;
+
+    SchedWorker *w = g_workers + worker;
+    uint64_t start = __atomic_load_n(&w->run_start_us, __ATOMIC_ACQUIRE);
+
+    *func = __atomic_load_n(&w->run_func, __ATOMIC_RELAXED);
+    *name = __atomic_load_n(&w->run_name, __ATOMIC_RELAXED);
+
+    return start;
 }
 
-RunQueue* rq_init() {
-    RunQueue* rq = malloc(RQ_MEMPOOL_SIZE);
-    rq->mempool = (Task*) (rq + 1);
 
-    rq->max = (RQ_MEMPOOL_SIZE - sizeof(RunQueue)) / sizeof(Task);
+/* Kills every task whose runtime has run out. Due tasks are only recorded by
+ * handle under g_deadline_mutex and killed after it is released, since
+ * tk_kill() may lock their RunQueue. A task reaped in between has a stale
+ * handle and its reused slot is left alone.
+ */
+int kill_dying_tasks() {
+    int i = 0;
 
-    for (int i = 0; i < rq->max; i++) 
-        (rq->mempool+i)->occupied = 0;
+    IHeapNode *due[DEADLINE_BATCH];
+    TaskHandle handles[DEADLINE_BATCH];
+    int n;
 
-    rq->count = 0;
-    rq->running = 0;
-    rq->lock = 0;
-    rq->head = NULL;
-    rq->tail = NULL;
-    rq->next = NULL;
+    do {
+        pthread_mutex_lock(&g_deadline_mutex);
 
-    return rq;
-}
+        n = ipq_dequeue_until(g_deadline_queue, TIMER_NOW_MS, due, DEADLINE_BATCH);
 
-int rq_empty(RunQueue* rq) {
-    return rq->count <= 0;
+        for (int j = 0; j < n; j++)
+            handles[j] = tk_handle(ipq_entry(due[j], Task, deadline));
+
+        pthread_mutex_unlock(&g_deadline_mutex);
+
+        // Reaping happens under the RunQueue's lock, so the check holds
+        for (int j = 0; j < n; j++) {
+            RunQueue *rq = handles[j].task->runqueue;
+
+            rq_lock(rq);
+            if (tk_alive(handles[j])) tk_kill(handles[j].task);
+            rq_unlock(rq);
+        }
+
+        i += n;
+
+    } while (n == DEADLINE_BATCH);
+
+    return i;
 }
 
-int rq_full(RunQueue* rq) {
-    return rq->max <= rq->count;
+
+int schedule(RunQueue* rq, milliseconds_t delay, milliseconds_t runtime,
+        int (*func)(Task*, Stack64*), Stack64* stack) {
+
+    return schedule_cb(rq, delay, runtime, func, stack, NULL);
 }
 
-void rq_add(RunQueue* rq, Task *tk) {
-    if (rq->head == NULL || rq->tail == NULL) {
-        rq->head = tk;
-        rq->tail = tk;
+int schedule_cb(RunQueue* rq, milliseconds_t delay, milliseconds_t runtime,
+        int (*func)(Task*, Stack64*), Stack64* stack, void (*callback)(Task*)) {
 
-    } else {
-        tk->next = rq->head;
-        rq->tail->next = tk;
-        rq->tail = tk;
-    }
+    Task* t = rq_create(rq, delay, runtime, func, stack, callback, NULL);
 
-    rq->running++;
+    return (t != NULL) - 1;
 }
 
-Task* rq_create(RunQueue* rq, int delay, int runtime, int
-        (*func)(Task*, Stack64*), Stack64* stack, void (*callback)(Task*)) {
+// Runs func right away, then every period ms, see tk_set_period()
+int schedule_periodic(RunQueue* rq, milliseconds_t period, milliseconds_t slack,
+        int (*func)(Task*, Stack64*), Stack64* stack) {
 
-    // TODO: Allocate more memory
-    if (rq == NULL || rq_full(rq)) return NULL;
+    if (rq == NULL) return -1;
 
-    Task* tk = rq->mempool;
-    while (tk->occupied) tk++;
+    // Held so the task can't be stolen and run before it is periodic
+    rq_lock(rq);
 
-    create_task(tk, rq, delay, runtime, func, stack, callback);
-    rq_add(rq, tk);
+    Task* t = rq_create(rq, 0, 0, func, stack, NULL, NULL);
+    if (t) tk_set_period(t, period, slack);
 
-    rq->count++;
+    rq_unlock(rq);
 
-    return tk;
+    return (t != NULL) - 1;
 }
 
-Task *rq_pop(RunQueue* rq) {
-    if (rq == NULL || rq_empty(rq)) return NULL;
+/* Like schedule_cb() but the task carries name from the start, so it shows up
+ * by name before it first runs */
+int schedule_named(RunQueue* rq, const char *name, milliseconds_t delay,
+        milliseconds_t runtime, int (*func)(Task*, Stack64*), Stack64* stack,
+        void (*callback)(Task*)) {
 
-    Task* old = rq->head;
+    if (rq == NULL) return -1;
 
-    if (!old->occupied) return NULL;
+    // Held so the task can't be stolen and run before it is named
+    rq_lock(rq);
 
-    if (rq->head == rq->tail) {
-        rq->head = NULL;
-        rq->tail = NULL;
+    Task* t = rq_create(rq, delay, runtime, func, stack, callback, NULL);
+    if (t) tk_set_name(t, name);
 
-    } else {
-        rq->head = rq->head->next;
-        rq->tail->next = rq->head;
-    }
+    rq_unlock(rq);
 
-    rq->running--;
+    return (t != NULL) - 1;
+}
 
-    return old;
+// Returns a handle with a NULL task on failure
+TaskHandle schedule_handle(RunQueue* rq, milliseconds_t delay,
+        milliseconds_t runtime, int (*func)(Task*, Stack64*), Stack64* stack,
+        void (*callback)(Task*)) {
+
+    TaskHandle handle = {NULL, 0};
+
+    rq_create(rq, delay, runtime, func, stack, callback, &handle);
+
+    return handle;
 }
 
-int rq_poprm(RunQueue* rq) {
-    Task *tk = rq_pop(rq);
 
-    rq->count--;
-    rm_task(tk);
+/* Work Stealing
+ * A stolen task is unlinked from its RunQueue while it runs on the thief and
+ * handed back afterwards, so only tasks of unpinned RunQueues may be stolen.
+ */
+static void tk_run_stolen(Task *tk) {
+    if (tk->blocked) tk_detach(tk);
 
-    return 0;
+    if (!tk_killed(tk))
+        tk_call(tk);
+
+    tk_return(tk);
 }
 
-int rq_run(RunQueue* rq) {
-    if (rq == NULL || rq->head == NULL) return -1;
+static int worker_steal(SchedWorker *self) {
+    for (int i = 1; i < g_workers_c; i++) {
+        SchedWorker *victim = g_workers + (self->id + i) % g_workers_c;
+        ll_node *node = victim->rqll->node;
+
+        while (node != NULL) {
+            RunQueue *rq = (RunQueue*) node->data;
+            node = node->next;
 
-    Task* current = rq->head;
+            if (rq->pinned || rq->running < 2 || !rq_trylock(rq)) continue;
 
-    if (!current->occupied) return -1;
+            // Take half of the runnable tasks
+            Task *stolen = NULL;
+            int n = rq->running / 2;
 
-    if (current->flags & RQ_FLAG_KILLED) {
+            for (int j = 0; j < n; j++) {
+                Task *tk = rq_pop(rq);
+                if (tk == NULL) break;
 
-        if (current->callback)
-            current->callback(current);
+                tk->next = stolen;
+                stolen = tk;
+            }
 
-        rq_poprm(rq);
-        return 1;
-    }
+            rq_unlock(rq);
 
-    current->func(current, current->stack);
+            int count = 0;
+            while (stolen) {
+                Task *tk = stolen;
+                stolen = stolen->next;
 
-    // Unlink from other tasks if sleeping
-    if (current->flags & RQ_FLAG_SLEEPING) {
-        rq_pop(rq);
+                tk_run_stolen(tk);
+                count++;
+            }
 
-    } else {
-        rq->head = rq->head->next;
-        rq->tail->next = current;
-        rq->tail = current;
+            self->steals += count;
+            return count;
+        }
     }
 
     return 0;
 }
 
-void tk_sleep(Task* task, milliseconds_t ms) {
-    if (ms < 1) return;
+/* Frame Budgets
+ * Time used past an allowance is carried over as debt and taken out of the
+ * next frame's allowance. The time check happens between tasks, a single
+ * task is never interrupted.
+ */
+static int64_t budget_allowance(microseconds_t budget, int64_t debt) {
+    return budget ? (int64_t) budget - debt : INT64_MAX;
+}
 
-    if (task->flags & RQ_FLAG_SLEEPING)
-        log_debug("Warning: putting already sleeping task %p to sleep", task);
+static void budget_settle(microseconds_t budget, int64_t *debt,
+        unsigned int *overruns, uint64_t spent) {
 
-    task->next_run = TIMER_NOW_MS + ms;
+    if (budget == 0) return;
 
-    task->flags |= RQ_FLAG_SLEEPING;
-    pq_enqueue(g_sleep_queue, task, task->next_run);
+    int64_t allowance = (int64_t) budget - *debt;
+
+    if (0 < allowance && allowance < (int64_t) spent) (*overruns)++;
+
+    *debt += (int64_t) spent - budget;
+    if (*debt < 0) *debt = 0;
 }
 
-ll_head* scheduler_init() {
-    ll_head* rqll = ll_init(1);
-    
-    // Initialize internal ll of sleeping tasks
-    if (g_sleep_queue == NULL) {
-        g_sleep_queue = pq_init(1);
-    }
+/* Inbox
+ * Bounded lock-free queue with one sequence number per cell. Any thread,
+ * signal handler or ISR may produce, only the RunQueue's worker consumes.
+ * Producers never wait on the consumer or on each other.
+ */
+static RQInjection *rq_inbox_claim(RunQueue *rq, unsigned int *pos) {
+    RQInbox *ib = rq->inbox;
+    unsigned int p = __atomic_load_n(&ib->tail, __ATOMIC_RELAXED);
 
-    // Initialize internal ll of dying tasks
-    if (g_dying_tasks == NULL) {
-        g_dying_tasks = ll_init(1);
+    for (;;) {
+        RQInjection *cell = ib->cells + (p & (RQ_INBOX_SIZE - 1));
+        unsigned int seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int diff = (int) (seq - p);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ib->tail, &p, p + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos = p;
+                return cell;
+            }
+
+        } else if (diff < 0) {
+            return NULL;
+
+        } else {
+            p = __atomic_load_n(&ib->tail, __ATOMIC_RELAXED);
+        }
     }
+}
 
-    g_default_rqll = rqll;
-    return rqll;
+// Publishes a claimed cell and wakes the RunQueue's worker if it is idle
+static void rq_inbox_publish(RunQueue *rq, RQInjection *cell, unsigned int pos) {
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < g_workers_c; i++)
+        if (g_workers[i].rqll == rq->rqll)
+            arch_wakeup_fd_signal(g_workers[i].wake_fd);
 }
 
-void scheduler_free() {
-    if (g_sleep_queue != NULL)
-        pq_free(g_sleep_queue);
+// Async-signal-safe, returns -1 if the inbox is full
+int rq_inject(RunQueue* rq, milliseconds_t delay, milliseconds_t runtime,
+        int (*func)(Task*, Stack64*), Stack64* stack, void (*callback)(Task*)) {
+
+    unsigned int pos;
+    RQInjection *cell = rq_inbox_claim(rq, &pos);
+
+    if (cell == NULL) return -1;
+
+    cell->delay = delay;
+    cell->runtime = runtime;
+    cell->func = func;
+    cell->stack = stack;
+    cell->callback = callback;
+    cell->call = NULL;
+
+    rq_inbox_publish(rq, cell, pos);
+
+    return 0;
+}
+
+// Runs call(a, b) on the RunQueue's worker, async-signal-safe
+int rq_inject_call(RunQueue* rq, void (*call)(uint64_t, uint64_t),
+        uint64_t a, uint64_t b) {
+
+    unsigned int pos;
+    RQInjection *cell = rq_inbox_claim(rq, &pos);
 
-    if (g_dying_tasks != NULL)
-        free(g_dying_tasks);
+    if (cell == NULL) return -1;
+
+    cell->func = NULL;
+    cell->call = call;
+    cell->args[0] = a;
+    cell->args[1] = b;
+
+    rq_inbox_publish(rq, cell, pos);
+
+    return 0;
 }
 
-// TODO: Keep track of all rqll's via global variable
-void scheduler_free_rqll(ll_head* rqll) {
-    if (rqll == NULL) return;
+// Creates the injected tasks and runs the injected calls in order
+static int rq_drain_inbox(RunQueue *rq) {
+    RQInbox *ib = rq->inbox;
+    int i = 0;
 
-    ll_node* node = rqll->node;
+    for (;; i++) {
+        unsigned int pos = ib->head;
+        RQInjection *cell = ib->cells + (pos & (RQ_INBOX_SIZE - 1));
 
-    if (node == NULL || node->data == NULL) return;
-    RunQueue* rq = (RunQueue*) node->data;
+        // Empty, or the next producer hasn't published yet
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1) break;
 
-    while (rq != NULL) {
-        RunQueue* prev = rq;
-        rq = rq->next;
-        free(prev);
-        prev = rq;
+        RQInjection req = *cell;
+
+        __atomic_store_n(&cell->seq, pos + RQ_INBOX_SIZE, __ATOMIC_RELEASE);
+        ib->head = pos + 1;
+
+        if (req.func)
+            rq_create(rq, req.delay, req.runtime, req.func, req.stack,
+                    req.callback, NULL);
+
+        else if (req.call)
+            req.call(req.args[0], req.args[1]);
     }
 
-    free(rqll);
-    rqll = NULL;
+    return i;
 }
 
-
-/* TODO: Rewrite tasks & runqueues to use ll_head
- *  This is a mess because rqll is ll_head and RunQueue is a separate linked
- *  list implementation; first the RunQueue is added to rqll list, then it must
- *  be added to the RunQueue list
+/* Runs every runnable task of rq once or until allowance is used up. Without
+ * a budget nothing is timed and spent stays 0, so dispatch reads no clock.
  */
-RunQueue* scheduler_new_rq_(ll_head* rqll) {
+static int rq_run_frame(RunQueue *rq, int64_t allowance, uint64_t *spent) {
+    int timed = allowance != INT64_MAX;
+    uint64_t start = timed ? time_now_ns() : 0;
+    int ran = 0;
 
-    // 1. Insert into rqll (type ll_head)
-    RunQueue* new_rq = rq_init();
-    ll_insert(rqll, new_rq);
+    rq_lock(rq);
+    rq_begin_pass(rq);
+    rq_unlock(rq);
 
-    // 2. Insert into the RunQueue structure
-    RunQueue* rq = (RunQueue*) rqll->tail->data;
-    rq->next = new_rq;
+    for (int i = rq->running; 0 < i && (int64_t) *spent < allowance; i--) {
+        rq_run(rq);
+        ran++;
 
-    
-    rq->next = new_rq;
-    return new_rq;
-}
+        if (timed) *spent = (time_now_ns() - start) / 1000;
+    }
 
-RunQueue* scheduler_new_rq() {
-    return scheduler_new_rq_(g_default_rqll);
+    return ran;
 }
 
-int wake_tasks() {
-    Task *stk = (Task*) pq_peek(g_sleep_queue);
+/* Picks the RunQueue furthest behind its share which has not run this frame.
+ * A RunQueue which sat idle is moved up to at most RQ_VRUNTIME_SLACK_US behind
+ * the others so it can't claim all the time it missed at once.
+ */
+static RunQueue *worker_next_rq(SchedWorker *self) {
+    RunQueue *next = NULL;
 
-    int i = 0;
-    while (!pq_empty(g_sleep_queue) && stk->next_run <= TIMER_NOW_MS) {
-        stk = pq_dequeue(g_sleep_queue);
+    for (ll_node *node = self->rqll->node; node && node->data; node = node->next) {
+        RunQueue *rq = (RunQueue*) node->data;
 
-        stk->flags &= ~RQ_FLAG_SLEEPING;
-        rq_add(stk->runqueue, stk);
+        if (rq->frame == self->frames) continue;
+
+        if (rq->vruntime + RQ_VRUNTIME_SLACK_US < self->min_vruntime)
+            rq->vruntime = self->min_vruntime - RQ_VRUNTIME_SLACK_US;
 
-        stk = (Task*) pq_peek(g_sleep_queue);
-        i++;
+        if (next == NULL || rq->vruntime < next->vruntime) next = rq;
     }
 
-    return i;
+    return next;
 }
 
-int rq_kill_all_tasks(RunQueue* rq) {
-    if (!rq) return -1;
-    Task* task = rq->head;
+/* Runs one frame of every RunQueue on the worker's RQLL, those furthest
+ * behind their weighted share of the worker first. RunQueues left over when
+ * the RQLL budget runs out wait for the next frame.
+ */
+static int worker_run_frame(SchedWorker *self, int *tasks_runnable) {
+    ll_head *rqll = self->rqll;
+    int count = rqll->count;
+    int tasks_ran = 0;
 
-    int count = 0;
-    int running = rq->running;
+    if (count <= 0) return 0;
+
+    int64_t rqll_allowance = budget_allowance(self->budget_us, self->debt_us);
+    uint64_t rqll_spent = 0;
+    uint64_t min_vruntime = UINT64_MAX;
+
+    self->frames++;
+
+    for (int i = 0; i < count; i++) {
+        RunQueue *rq = worker_next_rq(self);
+        uint64_t spent = 0;
 
-    for (int i=0; i < running; i++) {
-        if ( !(task->flags & RQ_FLAG_KILLED) ) {
-            tk_kill(task);
-            count++;
+        if (rq == NULL) break;
+
+        rq->frame = self->frames;
+        rq_drain_inbox(rq);
+
+        if ((int64_t) rqll_spent < rqll_allowance) {
+            int64_t allowance = budget_allowance(rq->budget_us, rq->debt_us);
+            int64_t left = rqll_allowance - rqll_spent;
+
+            if (0 < allowance)
+                tasks_ran += rq_run_frame(rq, min(allowance, left), &spent);
+
+            budget_settle(rq->budget_us, &rq->debt_us, &rq->overruns, spent);
+            rqll_spent += spent;
+
+            rq->vruntime += spent * RQ_WEIGHT_DEFAULT / rq->weight;
         }
 
-        task = task->next;
+        if (rq->running && rq->vruntime < min_vruntime)
+            min_vruntime = rq->vruntime;
+
+        *tasks_runnable += rq->running;
     }
 
+    // Only RunQueues with work pull the baseline forward
+    if (min_vruntime != UINT64_MAX && self->min_vruntime < min_vruntime)
+        self->min_vruntime = min_vruntime;
 
-    return count;
+    budget_settle(self->budget_us, &self->debt_us, &self->overruns, rqll_spent);
+
+    return tasks_ran;
 }
 
-/* TODO: Currently doesn't iterate RunQueueLists (rqll) because they are not
- * tracked in any way other than g_default_rqll and g_sleeping_tasks
+/* Tickless mode
+ * Blocks until the earliest sleeping task is due, until a parked task's fd is
+ * ready or until another thread wakes this worker through scheduler_wakeup()
+ * or by scheduling a task.
  */
-int kill_rqll(ll_head* rqll) {
-    if (ll_empty(rqll)) return -1;
+static void worker_idle_wait(SchedWorker *self) {
+    time_update();
 
-    int count = 0;
-    ll_node* node = rqll->node;
+    /* Go idle before reading the timers. A task queued after the reads below
+     * then sees idle and wakes this worker, one queued before them is seen.
+     */
+    __atomic_store_n(&self->idle_until, TIMER_NOW_MS + TICKLESS_MAX_WAIT_MS,
+            __ATOMIC_SEQ_CST);
+    __atomic_store_n(&self->idle, 1, __ATOMIC_SEQ_CST);
 
-    // Iterate all RunQueues on list
-    for (int i = 0; i < rqll->count; i++) {
-        RunQueue* rq = (RunQueue*) node->data;
+    pthread_mutex_lock(&g_sleep_mutex);
+    uint64_t next = tw_next_expiry(g_sleep_wheel);
+    pthread_mutex_unlock(&g_sleep_mutex);
 
-        if (rq->lock) continue;
+    pthread_mutex_lock(&g_deadline_mutex);
+    uint64_t next_kill = ipq_peek_weight(g_deadline_queue);
+    pthread_mutex_unlock(&g_deadline_mutex);
 
-        rq->lock = 1;
-        count += rq_kill_all_tasks(rq);
-        rq->lock = 0;
+    if (next_kill < next) next = next_kill;
 
-        node = node->next;
+    milliseconds_t wait_ms = TICKLESS_MAX_WAIT_MS;
+
+    if (next != UINT64_MAX) {
+        if (next <= TIMER_NOW_MS) {
+            __atomic_store_n(&self->idle, 0, __ATOMIC_SEQ_CST);
+            return;
+        }
+
+        if (next - TIMER_NOW_MS < wait_ms) wait_ms = next - TIMER_NOW_MS;
     }
 
-    return count;
-}
+    milliseconds_t idle_until = TIMER_NOW_MS + wait_ms;
+    __atomic_store_n(&self->idle_until, idle_until, __ATOMIC_SEQ_CST);
+
+    // Recheck after going idle so a concurrent rq_add() can't be missed
+    int runnable = 0;
+    for (ll_node* node = self->rqll->node; node != NULL; node = node->next)
+        runnable += ((RunQueue*) node->data)->running;
+
+    if (runnable == 0 && 0 < __atomic_load_n(&GLOBAL_TASK_COUNT, __ATOMIC_ACQUIRE)) {
+        // The timer's own millisecond, not wait_ms on top of the current one
+        TimeStamp deadline = {
+            .sec = idle_until / 1000,
+            .usec = idle_until % 1000 * 1000,
+        };
+        TimeStamp wake = time_spin_start(&deadline);
+
+        if (0 <= self->poll_fd) {
+            if (reactor_poll(self, &wake) == 0)
+                time_sleep_until(&deadline, -1);
+        } else
+            self->wakeups += time_sleep_until(&deadline, self->wake_fd);
+    }
 
-int scheduler_kill_all_tasks() {
+    __atomic_store_n(&self->idle, 0, __ATOMIC_SEQ_CST);
+
+    time_update();
+}
 
-    // Force wake all tasks and kill them
-    Task *stk = (Task*) pq_peek(g_sleep_queue);
-    while (!pq_empty(g_sleep_queue)) {
-        stk = pq_dequeue(g_sleep_queue);
+/* Wakes due tasks and runs one frame of the worker's RQLL. Returns the
+ * number of tasks which are still runnable.
+ */
+static int worker_pass(SchedWorker *self, int *tasks_ran) {
+    int tasks_runnable = 0;
 
-        stk->flags &= RQ_FLAG_KILLED;
+    // Virtual time runs every worker on one thread
+    t_worker = self;
 
-        rq_add(stk->runqueue, stk);
+    unsigned int epoch = __atomic_load_n(&g_kill_epoch, __ATOMIC_ACQUIRE);
+    if (self->kill_epoch != epoch) {
+        self->kill_epoch = epoch;
+        wake_killed_tasks();
+        reactor_unpark_killed(self);
     }
 
-    int count = kill_rqll(g_default_rqll);
-    
-    return count;
+    trace_poll();
+
+    scheduler_wake_tasks();
+    kill_dying_tasks();
+
+    if (0 < __atomic_load_n(&self->waiting_c, __ATOMIC_ACQUIRE))
+        reactor_poll(self, NULL);
+
+    *tasks_ran += worker_run_frame(self, &tasks_runnable);
+
+    if (*tasks_ran == 0 && 1 < g_workers_c && !g_virtual)
+        *tasks_ran += worker_steal(self);
+
+    return tasks_runnable;
 }
 
-int kill_dying_tasks() {
-    ll_node* dtk = g_dying_tasks->node;
-    int i = 0;
-    while (dtk != NULL) {
-        Task* tk = dtk->data;
-        if (TIMER_NOW_MS <= tk->kill_time) {
-            tk_kill(tk);
-            ll_node* next = dtk->next;
-            ll_rm(g_dying_tasks, tk);
-            dtk = next;
+static void worker_loop(SchedWorker *self) {
+    TimeStamp wall_start, wall_end, cpu_start, cpu_end;
 
-        } else {
-            dtk = dtk->next;
+    while (0 < __atomic_load_n(&GLOBAL_TASK_COUNT, __ATOMIC_ACQUIRE)) {
+        int tasks_ran = 0;
+
+        time_now(&wall_start);
+        arch_get_time_thread_cpu(&cpu_start);
+
+        int tasks_runnable = worker_pass(self, &tasks_ran);
+
+        // Idle time starts once there is nothing left to run
+        if (tasks_ran != 0 && tasks_runnable == 0) {
+            time_now(&wall_start);
+            arch_get_time_thread_cpu(&cpu_start);
         }
 
-        i++;
+        if (g_tickless && tasks_runnable == 0)
+            worker_idle_wait(self);
+        else
+            time_synchronize();
+
+        if (tasks_runnable == 0) {
+            time_now(&wall_end);
+            arch_get_time_thread_cpu(&cpu_end);
+
+            self->idle_us += ts_to_us(&wall_end) - ts_to_us(&wall_start);
+            self->idle_cpu_us += ts_to_us(&cpu_end) - ts_to_us(&cpu_start);
+        }
     }
-    return i;
 }
 
+/* Virtual time
+ * Every worker runs on the calling thread in a fixed order and the clock only
+ * moves when told to: by one frame while tasks are runnable, otherwise
+ * straight to the next sleeping task or runtime deadline.
+ */
+static void virtual_loop() {
+    while (0 < __atomic_load_n(&GLOBAL_TASK_COUNT, __ATOMIC_ACQUIRE)) {
+        int tasks_ran = 0;
+        int tasks_runnable = 0;
 
-int schedule(RunQueue* rq, int delay, int runtime,
-        int (*func)(Task*, Stack64*), Stack64* stack) {
+        for (int i = 0; i < g_workers_c; i++)
+            tasks_runnable += worker_pass(g_workers + i, &tasks_ran);
 
-    return schedule_cb(rq, delay, runtime, func, stack, NULL);
+        if (tasks_runnable != 0) {
+            time_synchronize();
+            continue;
+        }
+
+        uint64_t next = tw_next_expiry(g_sleep_wheel);
+        uint64_t next_kill = ipq_peek_weight(g_deadline_queue);
+
+        if (next_kill < next) next = next_kill;
+
+        // Only tasks parked on fds are left, keep time moving for them
+        if (next == UINT64_MAX) time_synchronize();
+        else if (TIMER_NOW_MS < next) time_advance_ms(next - TIMER_NOW_MS);
+    }
 }
 
-int schedule_cb(RunQueue* rq, int delay, int runtime,
-        int (*func)(Task*, Stack64*), Stack64* stack, void (*callback)(Task*)) {
+// Must be called before any task is scheduled since the clock jumps
+void scheduler_set_virtual(int enabled) {
+    assert_log(GLOBAL_TASK_COUNT == 0,
+            "Switching time mode with %u tasks alive", GLOBAL_TASK_COUNT);
 
-    Task* t = rq_create(rq, delay, runtime, func, stack, callback);
+    g_virtual = enabled;
+    time_set_virtual(enabled);
 
-    return (t != NULL) - 1;
+    if (g_sleep_wheel != NULL) {
+        tw_free(g_sleep_wheel);
+        g_sleep_wheel = tw_init(TIMER_NOW_MS);
+    }
 }
 
+static void *worker_thread(void *arg) {
+    time_update();
+    worker_loop((SchedWorker*) arg);
+    return NULL;
+}
 
+/* Runs rqll on the calling thread. When called with the default rqll every
+ * other RQLL gets its own worker thread for the duration of the call.
+ */
 void schedule_run(ll_head* rqll) {
-    int tasks_running = 1;
+    SchedWorker *self = scheduler_get_worker(rqll);
 
-    while (tasks_running) {
-        tasks_running = 0;
+    if (self == NULL) self = scheduler_new_worker(rqll);
 
-        wake_tasks();
+    assert_log(self != NULL, "failed to create worker for RQLL %p", rqll);
 
-        ll_node* node = rqll->node;
-        while (node != NULL) {
+    if (g_virtual && rqll == g_default_rqll) {
+        virtual_loop();
+        return;
+    }
 
-            RunQueue* rq = (RunQueue*) node->data;
+    if (rqll == g_default_rqll) {
+        g_workers_running = 1;
 
-            for (int i = rq->running; 0 < i; i--)
-                rq_run(rq);
+        for (int i = 0; i < g_workers_c; i++) {
+            SchedWorker *w = g_workers + i;
 
-            tasks_running += rq->count;
-            node = node->next;
+            if (w == self) continue;
+
+            w->spawned = pthread_create(&w->thread, NULL, worker_thread, w) == 0;
+
+            if (!w->spawned)
+                log_debug("Failed to spawn worker %u", w->id);
         }
+    }
+
+    worker_loop(self);
+
+    if (rqll == g_default_rqll) {
+        for (int i = 0; i < g_workers_c; i++) {
+            SchedWorker *w = g_workers + i;
+
+            if (!w->spawned) continue;
 
-        time_synchronize();
+            pthread_join(w->thread, NULL);
+            w->spawned = 0;
+        }
+
+        g_workers_running = 0;
     }
 }
 
@@ -485,3 +2232,8 @@ int ll_full (ll_head* head) {
 }
 
 
+
+// Only frees the list, not the data stored on it
+void ll_free(ll_head* head) {
+    free(head);
+}
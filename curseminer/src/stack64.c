@@ -320,6 +320,54 @@ uint64_t minh_get(Heap *h, int i) {
     return 0;
 }
 
+static void minh_sift_up(Heap *h, int i) {
+    while (0 < i) {
+        int pi = (i - 1) / 2;
+
+        if (h->mempool[pi].weight <= h->mempool[i].weight) break;
+
+        swap((h->mempool + i), (h->mempool + pi));
+        i = pi;
+    }
+}
+
+static void minh_sift_down(Heap *h, int i) {
+    for (;;) {
+        int target = i;
+        int l = i * 2 + 1;
+        int r = i * 2 + 2;
+
+        if (l < h->count && h->mempool[l].weight < h->mempool[target].weight)
+            target = l;
+
+        if (r < h->count && h->mempool[r].weight < h->mempool[target].weight)
+            target = r;
+
+        if (target == i) break;
+
+        swap((h->mempool + i), (h->mempool + target));
+        i = target;
+    }
+}
+
+// Removes the i'th node and returns its data, or 0
+uint64_t minh_delete(Heap *h, int i) {
+    if (i < 0 || h->count <= i) return 0;
+
+    uint64_t data = h->mempool[i].data;
+
+    h->count--;
+
+    if (i == h->count) return data;
+
+    h->mempool[i] = h->mempool[h->count];
+
+    minh_sift_up(h, i);
+    minh_sift_down(h, i);
+
+    return data;
+}
+
 uint64_t minh_pop(Heap *h) {
     if (h->count <= 0) return 0;
 
@@ -377,8 +425,23 @@ int pq_enqueue(PQueue64 *pq, void *ptr, uint64_t weight) {
     return pq->heap_insert(&pq->heap, (uint64_t) ptr, weight);
 }
 
+// Subtrees heavier than weight can't contain data and are skipped
+static int minh_find(Heap *h, int i, uint64_t data, uint64_t weight) {
+    if (h->count <= i || weight < h->mempool[i].weight) return -1;
+
+    if (h->mempool[i].data == data && h->mempool[i].weight == weight)
+        return i;
+
+    int j = minh_find(h, i * 2 + 1, data, weight);
+
+    return j != -1 ? j : minh_find(h, i * 2 + 2, data, weight);
+}
+
+// O(n) worst case, use IPQueue64 for frequent removals
 void pq_remove(PQueue64 *pq, void *ptr, uint64_t weight) {
-    // TODO: search for ptr and remove from heap
+    int i = minh_find(&pq->heap, 0, (uint64_t) ptr, weight);
+
+    if (i != -1) minh_delete(&pq->heap, i);
 }
 
 uint64_t _pq_peek(PQueue64 *pq, char dw) {
@@ -415,3 +478,421 @@ void *pq_dequeue(PQueue64 *pq) {
 void pq_free(PQueue64 *pq) {
     free(pq);
 }
+
+
+/* INDEXED PRIORITY QUEUE */
+
+IPQueue64 *ipq_init(int pages) {
+    IPQueue64 *pq = calloc(1, sizeof(IPQueue64));
+
+    pq->capacity = capacity_from_pages(pages, 0, sizeof(IHeapNode*));
+    pq->mempool = calloc(pq->capacity, sizeof(IHeapNode*));
+    pq->count = 0;
+
+    return pq;
+}
+
+void ipq_node_init(IHeapNode *node) {
+    node->weight = 0;
+    node->index = -1;
+}
+
+static void ipq_set(IPQueue64 *pq, int i, IHeapNode *node) {
+    pq->mempool[i] = node;
+    node->index = i;
+}
+
+static void ipq_sift_up(IPQueue64 *pq, int i) {
+    IHeapNode *node = pq->mempool[i];
+
+    while (0 < i) {
+        int pi = (i - 1) / IPQ_D;
+        IHeapNode *parent = pq->mempool[pi];
+
+        if (parent->weight <= node->weight) break;
+
+        ipq_set(pq, i, parent);
+        i = pi;
+    }
+
+    ipq_set(pq, i, node);
+}
+
+static void ipq_sift_down(IPQueue64 *pq, int i) {
+    IHeapNode *node = pq->mempool[i];
+
+    for (;;) {
+        int first = i * IPQ_D + 1;
+        int last = first + IPQ_D;
+        int target = -1;
+        uint64_t w = node->weight;
+
+        if (pq->count < last) last = pq->count;
+
+        for (int c = first; c < last; c++) {
+            if (pq->mempool[c]->weight < w) {
+                target = c;
+                w = pq->mempool[c]->weight;
+            }
+        }
+
+        if (target == -1) break;
+
+        ipq_set(pq, i, pq->mempool[target]);
+        i = target;
+    }
+
+    ipq_set(pq, i, node);
+}
+
+int ipq_enqueue(IPQueue64 *pq, IHeapNode *node, uint64_t weight) {
+    if (ipq_queued(node)) return ipq_update(pq, node, weight);
+
+    if (pq->capacity <= pq->count) {
+        int capacity = pq->capacity * 2;
+        IHeapNode **mempool = realloc(pq->mempool, capacity * sizeof(IHeapNode*));
+
+        if (mempool == NULL) return -1;
+
+        pq->mempool = mempool;
+        pq->capacity = capacity;
+    }
+
+    node->weight = weight;
+    ipq_set(pq, pq->count++, node);
+    ipq_sift_up(pq, node->index);
+
+    return 1;
+}
+
+int ipq_remove(IPQueue64 *pq, IHeapNode *node) {
+    if (!ipq_queued(node)) return 0;
+
+    int i = node->index;
+    IHeapNode *last = pq->mempool[--pq->count];
+
+    node->index = -1;
+
+    if (last != node) {
+        ipq_set(pq, i, last);
+        ipq_sift_up(pq, i);
+        ipq_sift_down(pq, last->index);
+    }
+
+    return 1;
+}
+
+// Handles both decrease-key and increase-key
+int ipq_update(IPQueue64 *pq, IHeapNode *node, uint64_t weight) {
+    if (!ipq_queued(node)) return -1;
+
+    uint64_t old = node->weight;
+    node->weight = weight;
+
+    if (weight < old) ipq_sift_up(pq, node->index);
+    else if (old < weight) ipq_sift_down(pq, node->index);
+
+    return 1;
+}
+
+IHeapNode *ipq_dequeue(IPQueue64 *pq) {
+    if (pq->count <= 0) return NULL;
+
+    IHeapNode *node = pq->mempool[0];
+    ipq_remove(pq, node);
+
+    return node;
+}
+
+/* Removes up to max nodes weighing at most weight and stores them in out, in
+ * no particular order. Such nodes form a subtree at the root, so they are
+ * found by a breadth-first walk using out as its queue. Few of them are
+ * removed one by one, many by compacting the rest and re-heapifying it.
+ */
+int ipq_dequeue_until(IPQueue64 *pq, uint64_t weight, IHeapNode **out, int max) {
+    int k = 0;
+
+    if (pq->count <= 0 || max <= 0 || weight < pq->mempool[0]->weight)
+        return 0;
+
+    out[k++] = pq->mempool[0];
+
+    for (int j = 0; j < k && k < max; j++) {
+        int first = out[j]->index * IPQ_D + 1;
+        int last = first + IPQ_D;
+
+        if (pq->count < last) last = pq->count;
+
+        for (int c = first; c < last && k < max; c++)
+            if (pq->mempool[c]->weight <= weight) out[k++] = pq->mempool[c];
+    }
+
+    int depth = 1;
+    for (int n = pq->count; IPQ_D <= n; n /= IPQ_D) depth++;
+
+    if ((int64_t) k * depth < pq->count) {
+        // Deepest first, so fewer removals have to move a collected node
+        for (int j = k - 1; 0 <= j; j--) ipq_remove(pq, out[j]);
+
+        return k;
+    }
+
+    for (int j = 0; j < k; j++) out[j]->index = -1;
+
+    int n = 0;
+
+    for (int i = 0; i < pq->count; i++) {
+        IHeapNode *node = pq->mempool[i];
+
+        if (node->index != -1) ipq_set(pq, n++, node);
+    }
+
+    pq->count = n;
+
+    if (1 < n)
+        for (int i = (n - 2) / IPQ_D; 0 <= i; i--) ipq_sift_down(pq, i);
+
+    return k;
+}
+
+IHeapNode *ipq_peek(IPQueue64 *pq) {
+    return 0 < pq->count ? pq->mempool[0] : NULL;
+}
+
+uint64_t ipq_peek_weight(IPQueue64 *pq) {
+    return 0 < pq->count ? pq->mempool[0]->weight : UINT64_MAX;
+}
+
+IHeapNode *ipq_get(IPQueue64 *pq, int i) {
+    return (0 <= i && i < pq->count) ? pq->mempool[i] : NULL;
+}
+
+int ipq_queued(IHeapNode *node) {
+    return 0 <= node->index;
+}
+
+int ipq_empty(IPQueue64 *pq) {
+    return pq->count == 0;
+}
+
+int ipq_clear(IPQueue64 *pq) {
+    int i = pq->count;
+
+    for (int j = 0; j < pq->count; j++)
+        pq->mempool[j]->index = -1;
+
+    pq->count = 0;
+
+    return i;
+}
+
+void ipq_free(IPQueue64 *pq) {
+    free(pq->mempool);
+    free(pq);
+}
+
+
+/* TIMER WHEEL
+ * Timers hash into TW_SLOTS slots per level, level n has a resolution of
+ * TW_SLOTS^n ticks. Slots on higher levels are cascaded down whenever the
+ * level below wraps around, timers too far out wait on the overflow list.
+ * Every slot is a circular list with a sentinel node so insert, cancel and
+ * expiring a whole slot are O(1). Timers in a slot expire in insertion order.
+ */
+
+void tw_list_init(TimerNode *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static int tw_list_empty(TimerNode *head) {
+    return head->next == head;
+}
+
+static void tw_list_append(TimerNode *head, TimerNode *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void tw_list_unlink(TimerNode *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = NULL;
+    node->prev = NULL;
+}
+
+// Moves all nodes of src to the end of dst
+static void tw_list_splice(TimerNode *dst, TimerNode *src) {
+    if (tw_list_empty(src)) return;
+
+    TimerNode *first = src->next;
+    TimerNode *last = src->prev;
+
+    first->prev = dst->prev;
+    last->next = dst;
+    dst->prev->next = first;
+    dst->prev = last;
+
+    tw_list_init(src);
+}
+
+TimerWheel *tw_init(uint64_t now) {
+    TimerWheel *tw = calloc(1, sizeof(TimerWheel));
+
+    for (int l = 0; l < TW_LEVELS; l++)
+        for (int i = 0; i < TW_SLOTS; i++)
+            tw_list_init(&tw->slots[l][i]);
+
+    tw_list_init(&tw->overflow);
+    tw->now = now;
+    tw->count = 0;
+
+    return tw;
+}
+
+static void tw_place(TimerWheel *tw, TimerNode *node) {
+    uint64_t expiry = node->expiry < tw->now ? tw->now : node->expiry;
+    uint64_t delta = expiry - tw->now;
+
+    for (int l = 0; l < TW_LEVELS; l++) {
+        if (delta < (uint64_t) 1 << (TW_SLOT_BITS * (l + 1))) {
+            int i = (expiry >> (TW_SLOT_BITS * l)) & TW_SLOT_MASK;
+            tw_list_append(&tw->slots[l][i], node);
+            return;
+        }
+    }
+
+    tw_list_append(&tw->overflow, node);
+}
+
+void tw_insert(TimerWheel *tw, TimerNode *node, uint64_t expiry, uint64_t data) {
+    node->expiry = expiry;
+    node->data = data;
+
+    tw_place(tw, node);
+    tw->count++;
+}
+
+int tw_pending(TimerNode *node) {
+    return node->next != NULL;
+}
+
+void tw_cancel(TimerWheel *tw, TimerNode *node) {
+    if (!tw_pending(node)) return;
+
+    tw_list_unlink(node);
+    tw->count--;
+}
+
+// Re-hashes every timer of a slot on the given level, returns the slot index
+static int tw_cascade(TimerWheel *tw, int level) {
+    int i = (tw->now >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK;
+    TimerNode tmp, *head = (level < TW_LEVELS) ? &tw->slots[level][i] : &tw->overflow;
+
+    tw_list_init(&tmp);
+    tw_list_splice(&tmp, head);
+
+    while (!tw_list_empty(&tmp)) {
+        TimerNode *node = tmp.next;
+        tw_list_unlink(node);
+        tw_place(tw, node);
+    }
+
+    return i;
+}
+
+/* Expires every timer due at or before now by appending them to the list
+ * headed by the sentinel expired. Returns the number of expired timers.
+ */
+int tw_advance(TimerWheel *tw, uint64_t now, TimerNode *expired) {
+    int count = 0;
+
+    if (tw->count == 0) {
+        if (tw->now <= now) tw->now = now + 1;
+        return 0;
+    }
+
+    while (tw->now <= now && 0 < tw->count) {
+        int i = tw->now & TW_SLOT_MASK;
+
+        if (i == 0) {
+            int l = 1;
+            while (l <= TW_LEVELS && tw_cascade(tw, l) == 0) l++;
+        }
+
+        TimerNode *slot = &tw->slots[0][i];
+
+        while (!tw_list_empty(slot)) {
+            TimerNode *node = slot->next;
+            tw_list_unlink(node);
+            tw_list_append(expired, node);
+
+            tw->count--;
+            count++;
+        }
+
+        tw->now++;
+    }
+
+    if (tw->count == 0 && tw->now <= now) tw->now = now + 1;
+
+    return count;
+}
+
+int tw_expire_all(TimerWheel *tw, TimerNode *expired) {
+    int count = tw->count;
+
+    for (int l = 0; l < TW_LEVELS; l++)
+        for (int i = 0; i < TW_SLOTS; i++)
+            tw_list_splice(expired, &tw->slots[l][i]);
+
+    tw_list_splice(expired, &tw->overflow);
+    tw->count = 0;
+
+    return count;
+}
+
+static uint64_t tw_list_min(TimerNode *head, uint64_t min) {
+    for (TimerNode *node = head->next; node != head; node = node->next)
+        if (node->expiry < min) min = node->expiry;
+
+    return min;
+}
+
+/* Returns the earliest expiry on the wheel or UINT64_MAX if it is empty.
+ * Only the first occupied slot of every level has to be searched.
+ */
+uint64_t tw_next_expiry(TimerWheel *tw) {
+    uint64_t min = UINT64_MAX;
+
+    if (tw->count == 0) return min;
+
+    for (int l = 0; l < TW_LEVELS; l++) {
+        int start = (tw->now >> (TW_SLOT_BITS * l)) & TW_SLOT_MASK;
+
+        /* The current slot of a higher level is either waiting to be cascaded
+         * or holds timers a full turn away, so it is always searched */
+        if (l != 0) min = tw_list_min(&tw->slots[l][start], min);
+
+        for (int j = (l != 0); j < TW_SLOTS; j++) {
+            TimerNode *head = &tw->slots[l][(start + j) & TW_SLOT_MASK];
+
+            if (!tw_list_empty(head)) {
+                min = tw_list_min(head, min);
+                break;
+            }
+        }
+    }
+
+    return tw_list_min(&tw->overflow, min);
+}
+
+int tw_empty(TimerWheel *tw) {
+    return tw->count == 0;
+}
+
+void tw_free(TimerWheel *tw) {
+    free(tw);
+}
@@ -6,28 +6,88 @@
 #include "curseminer/arch.h"
 
 TimeStamp INIT_TIME;
-TimeStamp TIMER_NOW;
 TimeStamp TIMER_NEVER = {0, 0};
 milliseconds_t INIT_TIME_MS;
-milliseconds_t TIMER_NOW_MS;
 milliseconds_t TIMER_NEVER_MS = -1;
 
-TimeStamp last_sync, refresh_rate;
+// Every thread has its own frame clock so workers never race on it
+_Thread_local TimeStamp TIMER_NOW;
+_Thread_local milliseconds_t TIMER_NOW_MS;
+_Thread_local nanoseconds_t TIMER_NOW_NS;
+
+/* Frame pacing
+ * Frames start at absolute targets one period apart, so time spent running a
+ * frame or oversleeping is taken out of the next wait instead of adding up.
+ * Each scheduler worker keeps its own target, 0 before its first frame.
+ */
+static nanoseconds_t g_frame_ns;
+static nanoseconds_t g_spin_ns;
+static TimeJitter g_jitter;
+static _Thread_local nanoseconds_t frame_target;
+
+// While enabled the clock only moves through time_advance_ms() and frames
+static int g_virtual = 0;
+static TimeStamp g_virtual_now;
+
+#define VIRTUAL_EPOCH_S 3600
 
 void time_init(int ips) {
-    refresh_rate.sec = ips / 1000000;
-    refresh_rate.usec = 1000000 / ips;
+    arch_fast_clock_init();
+
+    g_frame_ns = 1000000000 / ips;
 
     time_now(&INIT_TIME);
     time_now(&TIMER_NOW);
-    time_now(&last_sync);
 
     INIT_TIME_MS = time_to_ms(&TIMER_NOW);
     TIMER_NOW_MS = INIT_TIME_MS;
+    TIMER_NOW_NS = time_to_ns(&TIMER_NOW);
+    frame_target = TIMER_NOW_NS;
+}
+
+// Busy waits through the last us of every frame wait, 0 to only sleep
+void time_set_spin_us(microseconds_t us) {
+    g_spin_ns = (nanoseconds_t) us * 1000;
 }
 
 void time_now(TimeStamp* ts) {
-    arch_get_time_monotonic(ts);
+    if (g_virtual) *ts = g_virtual_now;
+    else arch_get_time_monotonic(ts);
+}
+
+/* Same clock as time_now() at nanosecond resolution, but without converting
+ * through a TimeStamp and on the TSC where possible. Meant for profiling,
+ * sleeps and deadlines use time_now() */
+nanoseconds_t time_now_ns() {
+    if (g_virtual) return time_to_ns(&g_virtual_now);
+
+    return arch_fast_clock_ns();
+}
+
+/* The virtual clock always starts at the same time so runs are reproducible,
+ * timestamps taken before switching modes can't be compared to later ones */
+void time_set_virtual(int enabled) {
+    if (enabled && !g_virtual) {
+        g_virtual_now.sec = VIRTUAL_EPOCH_S;
+        g_virtual_now.usec = 0;
+
+        INIT_TIME = g_virtual_now;
+        INIT_TIME_MS = time_to_ms(&INIT_TIME);
+    }
+
+    g_virtual = enabled;
+    time_update();
+}
+
+int time_is_virtual() {
+    return g_virtual;
+}
+
+void time_advance_ms(milliseconds_t ms) {
+    if (!g_virtual) return;
+
+    time_add_ms(&g_virtual_now, ms);
+    time_update();
 }
 
 void time_never(TimeStamp* ts) {
@@ -37,44 +97,31 @@ void time_never(TimeStamp* ts) {
     memcpy(ts, &never, sizeof(TimeStamp));
 }
 
-void time_add_ms(TimeStamp *ts, microseconds_t ms) {
-    seconds_t sec = ts->sec;
-    microseconds_t usec = ts->usec;
-
-    sec += ms / 1000;
-    usec += ms * 1000;
+void time_add_ms(TimeStamp *ts, milliseconds_t ms) {
+    uint64_t usec = ts->usec + (uint64_t) (ms % 1000) * 1000;
 
-    int carry = usec < ts->usec;
-    ts->sec = sec + carry;
-    ts->usec = usec;
+    ts->sec += ms / 1000 + usec / 1000000;
+    ts->usec = usec % 1000000;
 }
 
-TimeStamp time_diff(TimeStamp* a, TimeStamp* b) {
-    TimeStamp time_diff;
+// a - b in microseconds, 0 if b is later than a
+static uint64_t time_diff_us(TimeStamp* a, TimeStamp* b) {
+    int64_t us = (int64_t) (a->sec - b->sec) * 1000000
+               + (int64_t) a->usec - (int64_t) b->usec;
 
-    seconds_t asec = a->sec;
-    seconds_t bsec = b->sec;
-    microseconds_t ausec = a->usec;
-    microseconds_t busec = b->usec;
+    return us < 0 ? 0 : us;
+}
 
-    time_diff.sec = (bsec < asec) * (asec - bsec);
-    time_diff.usec = (0 <= asec - bsec) * (busec < ausec) * (ausec - busec);
+// a - b, borrowing a second when a's microseconds are below b's
+TimeStamp time_diff(TimeStamp* a, TimeStamp* b) {
+    uint64_t us = time_diff_us(a, b);
+    TimeStamp time_diff = {.sec = us / 1000000, .usec = us % 1000000};
 
     return time_diff;
 }
 
 milliseconds_t time_diff_millisec(TimeStamp* a, TimeStamp* b) {
-    milliseconds_t diff = 0;
-
-    seconds_t asec = a->sec;
-    seconds_t bsec = b->sec;
-    microseconds_t ausec = a->usec;
-    microseconds_t busec = b->usec;
-
-    diff += (bsec < asec) * (asec - bsec) * 1000;
-    diff += (0 <= asec - bsec) * (busec < ausec) * (ausec - busec) / 1000;
-
-    return diff;
+    return time_diff_us(a, b) / 1000;
 }
 
 int time_nready(TimeStamp* ts) {
@@ -100,7 +147,11 @@ int time_sleep(TimeStamp* ts) {
 }
 
 milliseconds_t time_to_ms(TimeStamp *ts) {
-    return ts->sec * 1000 + ts->usec / 1000;
+    return (milliseconds_t) ts->sec * 1000 + ts->usec / 1000;
+}
+
+nanoseconds_t time_to_ns(TimeStamp *ts) {
+    return (nanoseconds_t) ts->sec * 1000000000 + (nanoseconds_t) ts->usec * 1000;
 }
 
 void time_print(TimeStamp* t) {
@@ -116,16 +167,170 @@ void time_print_now() {
     time_print(&TIMER_NOW);
 }
 
+// Refreshes TIMER_NOW without sleeping and starts a new frame
+void time_update() {
+    time_now(&TIMER_NOW);
+    TIMER_NOW_MS = time_to_ms(&TIMER_NOW);
+    TIMER_NOW_NS = time_to_ns(&TIMER_NOW);
+    frame_target = TIMER_NOW_NS;
+}
+
+static nanoseconds_t now_ns() {
+    TimeStamp ts;
+    time_now(&ts);
+
+    return time_to_ns(&ts);
+}
+
+// Bucket 0 holds waits on time to the microsecond, bucket i 2^(i-1) to 2^i us
+static int jitter_bucket(nanoseconds_t late_ns) {
+    uint64_t us = late_ns / 1000;
+    int i = us ? 64 - __builtin_clzll(us) : 0;
+
+    return i < TIME_JITTER_BUCKETS ? i : TIME_JITTER_BUCKETS - 1;
+}
+
+static void jitter_record(nanoseconds_t target, int overrun) {
+    nanoseconds_t now = now_ns();
+    nanoseconds_t late_ns = target < now ? now - target : 0;
+    nanoseconds_t max = __atomic_load_n(&g_jitter.max_ns, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&g_jitter.frames, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_jitter.total_ns, late_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_jitter.buckets[jitter_bucket(late_ns)], 1,
+            __ATOMIC_RELAXED);
+
+    if (overrun) __atomic_fetch_add(&g_jitter.overruns, 1, __ATOMIC_RELAXED);
+
+    while (max < late_ns && !__atomic_compare_exchange_n(&g_jitter.max_ns,
+                &max, late_ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static TimeStamp ns_to_ts(nanoseconds_t ns) {
+    TimeStamp ts = {.sec = ns / 1000000000, .usec = ns % 1000000000 / 1000};
+
+    return ts;
+}
+
+// When a sleep towards deadline has to end to busy wait the rest
+TimeStamp time_spin_start(TimeStamp *deadline) {
+    nanoseconds_t target = time_to_ns(deadline);
+
+    return ns_to_ts(g_spin_ns < target ? target - g_spin_ns : 0);
+}
+
+/* Sleeps until the absolute target minus the spin window, then busy waits
+ * out the rest. Returns 1 if woken early through fd, see arch_sleep_until().
+ */
+static int pace_until(nanoseconds_t target, int fd) {
+    nanoseconds_t wake = g_spin_ns < target ? target - g_spin_ns : 0;
+
+    if (now_ns() < wake) {
+        TimeStamp ts = ns_to_ts(wake);
+
+        if (arch_sleep_until(&ts, fd)) return 1;
+    }
+
+    while (now_ns() < target);
+
+    return 0;
+}
+
+/* Like arch_sleep_until() but paced and counted in the jitter statistics.
+ * Returns 1 if woken through fd, which isn't counted.
+ */
+int time_sleep_until(TimeStamp *deadline, int fd) {
+    nanoseconds_t target = time_to_ns(deadline);
+
+    if (pace_until(target, fd)) return 1;
+
+    jitter_record(target, 0);
+
+    return 0;
+}
+
+// Takes over another thread's frame clock without starting a new frame
+void time_set_now(TimeStamp *now) {
+    TIMER_NOW = *now;
+    TIMER_NOW_MS = time_to_ms(&TIMER_NOW);
+    TIMER_NOW_NS = time_to_ns(&TIMER_NOW);
+}
+
 void time_synchronize() {
-    static TimeStamp delta, sleepts;
+    // A virtual frame takes no time at all
+    if (g_virtual) {
+        uint64_t usec = g_virtual_now.usec + g_frame_ns / 1000;
+        g_virtual_now.sec += usec / 1000000;
+        g_virtual_now.usec = usec % 1000000;
 
-    time_now(&TIMER_NOW);
+        time_update();
+        return;
+    }
+
+    nanoseconds_t now = now_ns();
+    nanoseconds_t next = frame_target + g_frame_ns;
+
+    // Catching up on more than a frame would only run a burst of frames
+    // back to back, start over from now instead
+    if (next + g_frame_ns <= now) {
+        if (frame_target) {
+            jitter_record(next, 1);
+            __atomic_fetch_add(&g_jitter.skipped, 1, __ATOMIC_RELAXED);
+        }
+
+        frame_target = now;
 
+    } else {
+        pace_until(next, -1);
+        jitter_record(next, next <= now);
+
+        frame_target = next;
+    }
+
+    time_now(&TIMER_NOW);
     TIMER_NOW_MS = time_to_ms(&TIMER_NOW);
-    delta = time_diff(&TIMER_NOW, &last_sync);
-    sleepts = time_diff(&refresh_rate, &delta);
+    TIMER_NOW_NS = time_to_ns(&TIMER_NOW);
+}
+
+void time_jitter(TimeJitter *out) {
+    out->frames = __atomic_load_n(&g_jitter.frames, __ATOMIC_RELAXED);
+    out->overruns = __atomic_load_n(&g_jitter.overruns, __ATOMIC_RELAXED);
+    out->skipped = __atomic_load_n(&g_jitter.skipped, __ATOMIC_RELAXED);
+    out->total_ns = __atomic_load_n(&g_jitter.total_ns, __ATOMIC_RELAXED);
+    out->max_ns = __atomic_load_n(&g_jitter.max_ns, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < TIME_JITTER_BUCKETS; i++)
+        out->buckets[i] = __atomic_load_n(g_jitter.buckets + i, __ATOMIC_RELAXED);
+}
+
+void time_jitter_reset() {
+    memset(&g_jitter, 0, sizeof(g_jitter));
+}
+
+// Upper bound of the bucket holding the percent-th percentile, in us
+microseconds_t time_jitter_percentile(TimeJitter *jit, int percent) {
+    uint64_t rank = (jit->frames * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    if (jit->frames == 0) return 0;
+
+    for (int i = 0; i < TIME_JITTER_BUCKETS - 1; i++) {
+        seen += jit->buckets[i];
+        if (rank <= seen) return (microseconds_t) 1 << i;
+    }
+
+    return jit->max_ns / 1000;
+}
+
+void time_jitter_dump(FILE *file) {
+    TimeJitter jit;
+    time_jitter(&jit);
 
-    time_sleep(&sleepts);
-    time_now(&last_sync);
+    fprintf(file, "frames=%" PRIu64 " overruns=%" PRIu64 " skipped=%" PRIu64
+            " avg_us=%" PRIu64 " p50_us=%u p99_us=%u max_us=%" PRIu64 "\n",
+            jit.frames, jit.overruns, jit.skipped,
+            jit.frames ? jit.total_ns / jit.frames / 1000 : 0,
+            time_jitter_percentile(&jit, 50), time_jitter_percentile(&jit, 99),
+            jit.max_ns / 1000);
 }
 
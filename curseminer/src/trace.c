@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curseminer/globals.h"
+#include "curseminer/scheduler.h"
+#include "curseminer/arch.h"
+#include "curseminer/trace.h"
+
+/* Events go to a ring per thread without taking any lock, the oldest ones are
+ * overwritten once it is full. A flush writes every ring out as Chrome
+ * trace-event JSON with one process per RunQueue and one thread per worker.
+ */
+typedef struct TraceEvent {
+    int (*func)(Task*, Stack64*);
+    const char *name;
+    Task *task;
+    uint64_t ts_us, dur_us;
+    milliseconds_t now_ms, until_ms;
+    unsigned int runqueue, tid;
+    byte_t type;
+} TraceEvent;
+
+/* Only the owning thread writes to a ring, head is published after each
+ * event so a flush from another thread can tell which events it may read */
+typedef struct TraceRing {
+    struct TraceRing *next;
+    unsigned int id;
+    uint64_t head;
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+int TRACE_ENABLED = 0;
+
+static int g_flush_pending = 0;
+static char g_path[256];
+static TraceRing *g_rings = NULL;
+static unsigned int g_rings_c = 0;
+static unsigned int g_gen = 1;
+static _Thread_local TraceRing *t_trace = NULL;
+static _Thread_local unsigned int t_trace_gen = 0;
+
+
+uint64_t trace_now_us() {
+    return time_now_ns() / 1000;
+}
+
+static TraceRing *trace_ring() {
+    if (t_trace_gen == __atomic_load_n(&g_gen, __ATOMIC_ACQUIRE))
+        return t_trace;
+
+    TraceRing *ring = calloc(1, sizeof(TraceRing));
+    t_trace = ring;
+    t_trace_gen = g_gen;
+
+    if (ring == NULL) return NULL;
+
+    ring->id = __atomic_fetch_add(&g_rings_c, 1, __ATOMIC_RELAXED);
+    ring->next = __atomic_load_n(&g_rings, __ATOMIC_ACQUIRE);
+
+    while (!__atomic_compare_exchange_n(&g_rings, &ring->next, ring, 1,
+                __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+    return ring;
+}
+
+/* Records an event for task on the calling thread's ring. worker is the
+ * scheduler worker the thread runs, or -1 if it runs none.
+ */
+void trace_record(trace_event_t type, Task *task, int worker, uint64_t ts_us,
+        uint64_t dur_us) {
+
+    TraceRing *ring = trace_ring();
+
+    if (ring == NULL) return;
+
+    uint64_t head = ring->head;
+    TraceEvent *ev = ring->events + head % TRACE_RING_SIZE;
+
+    ev->func = task->func;
+    ev->name = task->name;
+    ev->task = task;
+    ev->ts_us = ts_us;
+    ev->dur_us = dur_us;
+    ev->now_ms = TIMER_NOW_MS;
+    ev->until_ms = task->next_run;
+    ev->runqueue = task->runqueue ? task->runqueue->id : 0;
+    ev->tid = 0 <= worker ? (unsigned int) worker
+        : SCHEDULER_WORKERS_MAX + ring->id;
+    ev->type = type;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Writes s as a quoted JSON string
+static void trace_write_string(FILE *f, const char *s) {
+    fputc('"', f);
+
+    for (; *s; s++) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+
+    fputc('"', f);
+}
+
+static void trace_write_event(FILE *f, TraceEvent *ev) {
+    static const char *kinds[] = {"run", "sleep", "wake", "kill"};
+    char sym[64];
+
+    arch_symbol_name((void*) ev->func, sym, sizeof(sym));
+    const char *name = ev->name ? ev->name : sym;
+
+    if (ev->type == TRACE_RUN) {
+        fprintf(f, "{\"name\":");
+        trace_write_string(f, name);
+        fprintf(f, ",\"cat\":\"task\",\"ph\":\"X\","
+                "\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"pid\":%u,\"tid\":%u,"
+                "\"args\":{\"task\":\"%p\",\"now_ms\":%" PRIu64 "}}",
+                ev->ts_us, ev->dur_us, ev->runqueue, ev->tid,
+                (void*) ev->task, ev->now_ms);
+
+    } else {
+        fprintf(f, "{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"i\",\"s\":\"t\","
+                "\"ts\":%" PRIu64 ",\"pid\":%u,\"tid\":%u,\"args\":{\"task\":",
+                kinds[ev->type], ev->ts_us, ev->runqueue, ev->tid);
+        trace_write_string(f, name);
+        fprintf(f, ",\"id\":\"%p\",\"now_ms\":%" PRIu64,
+                (void*) ev->task, ev->now_ms);
+
+        if (ev->type == TRACE_SLEEP) fprintf(f, ",\"until_ms\":%" PRIu64, ev->until_ms);
+
+        fprintf(f, "}}");
+    }
+}
+
+// Starts recording, events are written to path on every flush
+int trace_start(const char *path) {
+    if (sizeof(g_path) <= strlen(path)) return -1;
+
+    strcpy(g_path, path);
+    __atomic_store_n(&TRACE_ENABLED, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Writes the events still held by every ring to the trace file, replacing
+ * it. Events overwritten while their ring was being copied are left out.
+ */
+int trace_flush() {
+    if (g_path[0] == '\0') return -1;
+
+    FILE *f = fopen(g_path, "w");
+    TraceEvent *copy = malloc(sizeof(TraceEvent) * TRACE_RING_SIZE);
+    uint64_t rqs_named[4] = {0};
+    int n = 0;
+
+    if (f == NULL || copy == NULL) {
+        if (f) fclose(f);
+        free(copy);
+        return -1;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (TraceRing *ring = __atomic_load_n(&g_rings, __ATOMIC_ACQUIRE);
+            ring; ring = ring->next) {
+
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head < TRACE_RING_SIZE ? 0 : head - TRACE_RING_SIZE;
+
+        for (uint64_t i = first; i < head; i++)
+            copy[i - first] = ring->events[i % TRACE_RING_SIZE];
+
+        uint64_t after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        // The producer may be halfway through overwriting event after - SIZE
+        uint64_t valid = after < TRACE_RING_SIZE ? 0 : after - TRACE_RING_SIZE + 1;
+
+        for (uint64_t i = first < valid ? valid : first; i < head; i++) {
+            TraceEvent *ev = copy + (i - first);
+            unsigned int rq = ev->runqueue;
+
+            if (n++) fprintf(f, ",\n");
+
+            // Name each RunQueue's process the first time it shows up
+            if (rq < 256 && !(rqs_named[rq / 64] & (uint64_t) 1 << rq % 64)) {
+                rqs_named[rq / 64] |= (uint64_t) 1 << rq % 64;
+
+                fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+                        "\"args\":{\"name\":\"RunQueue %u\"}},\n", rq, rq);
+            }
+
+            trace_write_event(f, ev);
+        }
+    }
+
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    free(copy);
+
+    return n;
+}
+
+/* Async-signal-safe, the next worker to start a frame flushes the trace. Meant
+ * for signal handlers, see arch_on_user_signal() */
+void trace_request_flush() {
+    __atomic_store_n(&g_flush_pending, 1, __ATOMIC_RELEASE);
+    scheduler_wakeup();
+}
+
+// Flushes if trace_request_flush() was called since the last poll
+void trace_poll() {
+    if (__atomic_exchange_n(&g_flush_pending, 0, __ATOMIC_ACQ_REL))
+        trace_flush();
+}
+
+// Stops recording and writes out what was recorded
+void trace_stop() {
+    if (!__atomic_exchange_n(&TRACE_ENABLED, 0, __ATOMIC_ACQ_REL)) return;
+
+    trace_flush();
+}
+
+// Drops every ring, threads allocate a new one on their next event
+void trace_free() {
+    trace_stop();
+
+    TraceRing *ring = __atomic_exchange_n(&g_rings, NULL, __ATOMIC_ACQ_REL);
+
+    while (ring) {
+        TraceRing *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+
+    __atomic_add_fetch(&g_gen, 1, __ATOMIC_RELEASE);
+    g_path[0] = '\0';
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include "curseminer/globals.h"
+#include "curseminer/scheduler.h"
+#include "curseminer/arch.h"
+#include "curseminer/watchdog.h"
+
+/* The ring keeps the last WATCHDOG_RING_SIZE events, older ones are
+ * overwritten. Symbols are only resolved for tasks without a name and only
+ * when the ring is dumped. g_mutex is a leaf, nothing is locked under it.
+ */
+microseconds_t WATCHDOG_US = 0;
+milliseconds_t WATCHDOG_STUCK_MS = 0;
+
+static WatchdogEvent g_ring[WATCHDOG_RING_SIZE];
+static unsigned int g_ring_c = 0;
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t g_monitor;
+
+// Start of the run each worker was last reported stuck in
+static uint64_t g_flagged_us[SCHEDULER_WORKERS_MAX];
+
+
+static void watchdog_push(WatchdogEvent *ev) {
+    pthread_mutex_lock(&g_mutex);
+    g_ring[g_ring_c++ % WATCHDOG_RING_SIZE] = *ev;
+    pthread_mutex_unlock(&g_mutex);
+}
+
+// The task's name, or the symbol of its Task.func if it has none
+static void watchdog_task_name(int (*func)(Task*, Stack64*), const char *name,
+        char *buf, int n) {
+
+    if (name) snprintf(buf, n, "%s", name);
+    else arch_symbol_name((void*) func, buf, n);
+}
+
+void watchdog_record(Task *task, unsigned int worker, uint64_t start_us,
+        uint64_t took_us) {
+
+    WatchdogEvent ev = {
+        .func = task->func,
+        .name = task->name,
+        .runqueue = task->runqueue,
+        .worker = worker,
+        .stuck = 0,
+        .start_us = start_us,
+        .took_us = took_us,
+    };
+
+    watchdog_push(&ev);
+}
+
+// Records every run of Task.func which takes at least us, 0 disables it
+void watchdog_set_threshold(microseconds_t us) {
+    __atomic_store_n(&WATCHDOG_US, us, __ATOMIC_RELAXED);
+}
+
+static void *watchdog_loop(void *arg) {
+    milliseconds_t stuck_ms;
+
+    while ((stuck_ms = __atomic_load_n(&WATCHDOG_STUCK_MS, __ATOMIC_ACQUIRE))) {
+        uint64_t now_us = arch_fast_clock_ns() / 1000;
+
+        for (unsigned int i = 0; i < SCHEDULER_WORKERS_MAX; i++) {
+            WatchdogEvent ev = {.worker = i, .stuck = 1};
+            uint64_t start = scheduler_worker_running(i, &ev.func, &ev.name);
+
+            if (start == 0 || start == g_flagged_us[i]
+                    || now_us - start < (uint64_t) stuck_ms * 1000)
+                continue;
+
+            // Only reported once per run
+            g_flagged_us[i] = start;
+
+            char name[64];
+            watchdog_task_name(ev.func, ev.name, name, sizeof(name));
+
+            fprintf(stderr, "Watchdog: worker %u stuck in %s for %" PRIu64 "ms\n",
+                    i, name, (now_us - start) / 1000);
+
+            ev.start_us = start;
+            ev.took_us = now_us - start;
+            watchdog_push(&ev);
+        }
+
+        TimeStamp nap = {.sec = 0, .usec = stuck_ms * 1000 / 4};
+        if (nap.usec < 1000) nap.usec = 1000;
+        if (1000000 <= nap.usec) {
+            nap.sec = nap.usec / 1000000;
+            nap.usec %= 1000000;
+        }
+
+        arch_sleep(&nap);
+    }
+
+    return NULL;
+}
+
+/* Starts a thread which flags any worker stuck in one Task.func for stuck_ms
+ * or longer, 0 stops it. Returns -1 if the thread could not be started.
+ */
+int watchdog_monitor(milliseconds_t stuck_ms) {
+    milliseconds_t running = __atomic_exchange_n(&WATCHDOG_STUCK_MS, stuck_ms,
+            __ATOMIC_ACQ_REL);
+
+    if (running && stuck_ms == 0) pthread_join(g_monitor, NULL);
+
+    if (running == 0 && stuck_ms != 0
+            && pthread_create(&g_monitor, NULL, watchdog_loop, NULL) != 0) {
+        __atomic_store_n(&WATCHDOG_STUCK_MS, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Copies up to max of the most recent events, oldest first
+int watchdog_events(WatchdogEvent *out, int max) {
+    pthread_mutex_lock(&g_mutex);
+
+    unsigned int c = g_ring_c;
+    unsigned int n = c < WATCHDOG_RING_SIZE ? c : WATCHDOG_RING_SIZE;
+    if (max < n) n = max;
+
+    for (unsigned int i = 0; i < n; i++)
+        out[i] = g_ring[(c - n + i) % WATCHDOG_RING_SIZE];
+
+    pthread_mutex_unlock(&g_mutex);
+
+    return n;
+}
+
+void watchdog_dump(FILE *f) {
+    WatchdogEvent events[WATCHDOG_RING_SIZE];
+    int n = watchdog_events(events, WATCHDOG_RING_SIZE);
+
+    fprintf(f, "%-16s %-4s %-6s %10s  %s\n",
+            "START_S", "WRK", "KIND", "TOOK_US", "TASK");
+
+    for (int i = 0; i < n; i++) {
+        WatchdogEvent *ev = events + i;
+        char name[64];
+
+        watchdog_task_name(ev->func, ev->name, name, sizeof(name));
+
+        fprintf(f, "%9" PRIu64 ".%06" PRIu64 " %-4u %-6s %10" PRIu64 "  %s\n",
+                ev->start_us / 1000000, ev->start_us % 1000000, ev->worker,
+                ev->stuck ? "stuck" : "slow", ev->took_us, name);
+    }
+}
@@ -6,8 +6,10 @@
 #include "curseminer/globals.h"
 #include "curseminer/world.h"
 #include "curseminer/util.h"
+#include "curseminer/parallel.h"
 
 #define DEFAULT_CHUNK_ARENA_SIZE PAGE_SIZE * 16
+#define CHUNK_POPULATE_GRAIN 4 // Columns per parallel_for() chunk
 
 /* Global Variables
  * Initialized in world_init() 
@@ -237,6 +239,39 @@ static ChunkType chunk_determine_type(World *world, Chunk *chunk) {
     else return CHUNK_TYPE_VOID;
 }
 
+typedef struct ChunkPopulateCtx {
+    Chunk *chunk;
+    int chunk_s;
+    int (*populate_f) (double);
+    double (*noise_f) (NoiseLattice*, double, double);
+} ChunkPopulateCtx;
+
+// Fills columns [begin, end) of the chunk, each column only writes its own cells
+static void chunk_populate_columns(int64_t begin, int64_t end, void *arg) {
+    ChunkPopulateCtx *ctx = arg;
+    Chunk *chunk = ctx->chunk;
+    int chunk_s = ctx->chunk_s;
+    double resolution = 20.0;
+
+    int starty = chunk->tl_y;
+    int endy = starty + chunk_s;
+
+    for (int x = chunk->tl_x + begin; x < chunk->tl_x + end; x++) {
+        for (int y=starty; y<endy; y++) {
+            double lattice_x = fabs(((double) x) / resolution);
+            double lattice_y = fabs(((double) y) / resolution);
+            double v = ctx->noise_f(LATTICE_2D, lattice_x, lattice_y);
+
+            int tid = ctx->populate_f(v);
+
+            int _x = abs(x) % chunk_s;
+            int _y = abs(y) % chunk_s;
+
+            chunk->data[_x * chunk_s + (_y % chunk_s)] = tid;
+        }
+    }
+}
+
 static int chunk_populate(World *world, Chunk *chunk) {
     int (*populate_f) (double);
     double (*noise_f) (NoiseLattice*, double, double);
@@ -273,28 +308,15 @@ static int chunk_populate(World *world, Chunk *chunk) {
             populate_f = chunk_populate_void;
     }
 
-    int chunk_s = world->chunk_s;
-    double resolution = 20.0;
-
-    int startx = chunk->tl_x;
-    int starty = chunk->tl_y;
-    int endx = startx + chunk_s;
-    int endy = starty + chunk_s;
-
-    for (int x=startx; x<endx; x++) {
-        for (int y=starty; y<endy; y++) {
-            double lattice_x = fabs(((double) x) / resolution);
-            double lattice_y = fabs(((double) y) / resolution);
-            double v = noise_f(LATTICE_2D, lattice_x, lattice_y);
-
-            int tid = populate_f(v);
+    ChunkPopulateCtx ctx = {
+        .chunk = chunk,
+        .chunk_s = world->chunk_s,
+        .populate_f = populate_f,
+        .noise_f = noise_f,
+    };
 
-            int _x = abs(x) % chunk_s;
-            int _y = abs(y) % chunk_s;
-
-            chunk->data[_x * chunk_s + (_y % chunk_s)] = tid;
-        }
-    }
+    parallel_for(0, world->chunk_s, CHUNK_POPULATE_GRAIN,
+            chunk_populate_columns, &ctx);
 
     return 1;
 }
@@ -467,7 +489,7 @@ World *world_init(int chunk_s, int lattice_length, size_t chunk_mem_max) {
     new_world->chunk_arenas = NULL;
     new_world->entity_c = 0;
     new_world->entity_maxc = 256;
-    new_world->entities = pq_init( (new_world->entity_maxc * sizeof(Entity) + PAGE_SIZE) / PAGE_SIZE );
+    new_world->entities = ipq_init( (new_world->entity_maxc * sizeof(IHeapNode*) + PAGE_SIZE) / PAGE_SIZE );
     new_world->chunk_max = chunk_max;
     new_world->chunk_mem_used = 0;
     new_world->chunk_mem_max = chunk_mem_max;
@@ -572,7 +594,7 @@ void world_setxy(World *world, int x, int y, int tid) {
 void world_free(World *world) {
     chunk_free_all(world);
     noise_free(LATTICE_2D);
-    pq_free(world->entities);
+    ipq_free(world->entities);
     free(world);
 }
 
@@ -92,7 +92,7 @@ void app_main(void)
     GameContext *gctx = game_init(&gcfg, GLOBALS.world);
     GLOBALS.game = gctx;
 
-    schedule_cb(g_runqueue, 0, 0, game_update, NULL, cb_exit);
+    schedule_named(g_runqueue, "game_update", 0, 0, game_update, NULL, cb_exit);
     schedule_run(GLOBALS.runqueue_list);
 
     printf("Restarting now.\n");